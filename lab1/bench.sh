@@ -0,0 +1,203 @@
+#!/bin/sh
+# Run sender/receiver pairs over a generated line feed and print the time
+# each side reports plus the receiver's latency and throughput, one
+# configuration per row, then the cost of -c checksums on each method, then
+# the bandwidth of a binary file transfer per
+# chunk size, then round trip times per payload size through each method,
+# then the aggregate throughput of the method 7 queue
+# as senders and receivers are added, then the wall time of many small
+# transfers with and without a persistent receiver.
+#
+# usage: ./bench.sh [lines]
+# BINARY_MB sets the size of the binary file (default 64), RTT_SIZES and
+# RTT_ROUNDS the ping-pong payloads and round trips per size.
+
+LINES=${1:-200000}
+DIR=$(mktemp -d)
+INPUT=$DIR/input.txt
+seq -f "message %g" 1 "$LINES" > "$INPUT"
+
+# run <label> <method> [options...]
+# SEND_CPU and RECV_CPU, when set, pin each side with -a.
+run() {
+    label=$1
+    method=$2
+    shift 2
+    ./sender -q ${SEND_CPU:+-a $SEND_CPU} "$@" "$method" "$INPUT" > "$DIR/send.out" &
+    sleep 0.2 # the sender creates the shared memory segment
+    ./receiver -q ${RECV_CPU:+-a $RECV_CPU} "$@" "$method" > "$DIR/recv.out"
+    wait
+    printf "%-24s send %9s s  recv %9s s  p50 %8s us  p99 %8s us  %8s msg/s\n" "$label" \
+        "$(grep "Total time" "$DIR/send.out" | awk '{ print $(NF - 1) }')" \
+        "$(grep "Total time" "$DIR/recv.out" | awk '{ print $(NF - 1) }')" \
+        "$(grep "receive latency" "$DIR/recv.out" | awk '{ print $5 }')" \
+        "$(grep "receive latency" "$DIR/recv.out" | awk '{ print $9 }')" \
+        "$(grep "receive throughput" "$DIR/recv.out" | awk '{ print $8 }')"
+}
+
+# checked <label> <method> [options...]: receive throughput without and with -c
+checked() {
+    label=$1
+    shift
+    plain=$(run "$label" "$@" | awk '{ print $(NF - 1) }')
+    crc=$(run "$label" "$@" -c | awk '{ print $(NF - 1) }')
+    printf "%-24s %10s msg/s  crc32c %10s msg/s  overhead %6s%%\n" "$label" "$plain" "$crc" \
+        "$(awk "BEGIN { printf \"%+.1f\", 100 * ($plain / $crc - 1) }")"
+}
+
+# binary <label> <method> [options...]: the random file as -B chunks, checked on arrival
+binary() {
+    label=$1
+    method=$2
+    shift 2
+    ./sender -q "$@" "$method" "$DIR/input.bin" > "$DIR/send.out" &
+    sleep 0.2
+    ./receiver -q -o "$DIR/output.bin" "$@" "$method" > "$DIR/recv.out"
+    wait
+    # the receive time, not the histogram span: the first chunks wait for the receiver to start
+    seconds=$(grep "Total time" "$DIR/recv.out" | awk '{ print $(NF - 1) }')
+    printf "%-24s recv %9s s  %8.0f MB/s  %s\n" "$label" "$seconds" \
+        "$(awk "BEGIN { print $BINARY_MB / $seconds }")" \
+        "$(cmp -s "$DIR/input.bin" "$DIR/output.bin" && echo intact || echo CORRUPT)"
+}
+
+# rtt <label> <method> [options...]: the sender's table of round trips through the receiver's echo
+rtt() {
+    label=$1
+    method=$2
+    shift 2
+    ./sender -R "$RTT_SIZES" -n "$RTT_ROUNDS" "$@" "$method" > "$DIR/send.out" &
+    sleep 0.2
+    ./receiver -R "$@" "$method" > "$DIR/recv.out"
+    wait
+    echo "$label"
+    grep -A 32 "p50 us" "$DIR/send.out" | grep "^ "
+}
+
+# cpu_near <sibling|core|socket>: a cpu that is a hyperthread sibling of cpu 0,
+# another core on its socket, or on another socket
+cpu_near() {
+    top=/sys/devices/system/cpu/cpu0/topology
+    for dir in /sys/devices/system/cpu/cpu[1-9]*; do
+        [ -d "$dir/topology" ] || continue
+        same_socket=$([ "$(cat $dir/topology/physical_package_id)" = "$(cat $top/physical_package_id)" ] && echo 1)
+        same_core=$([ "$(cat $dir/topology/core_id)" = "$(cat $top/core_id)" ] && echo 1)
+        case $1 in
+        sibling) [ "$same_socket" ] && [ "$same_core" ] ;;
+        core) [ "$same_socket" ] && [ -z "$same_core" ] ;;
+        socket) [ -z "$same_socket" ] ;;
+        esac && echo "${dir##*cpu}" && return
+    done
+}
+
+# pinned <label> <receiver cpu>: the shm ring with the sender on cpu 0
+pinned() {
+    [ -n "$2" ] || return
+    SEND_CPU=0 RECV_CPU=$2
+    run "$1" 2 -r 64
+    unset SEND_CPU RECV_CPU
+}
+
+# mpmc <senders> <receivers>: every sender streams the whole input
+mpmc() {
+    for i in $(seq "$1"); do
+        ./sender -q -P "$1" -C "$2" 7 "$INPUT" > "$DIR/send$i.out" &
+    done
+    for i in $(seq "$2"); do
+        ./receiver -q -P "$1" -C "$2" 7 > "$DIR/recv$i.out" &
+    done
+    wait
+    printf "%2s senders %2s receivers  %8s msg/s  %s\n" "$1" "$2" \
+        "$(cat "$DIR"/recv*.out | grep "aggregate throughput" | awk '{ print $12 }')" \
+        "$(cat "$DIR"/recv*.out | grep "aggregate delivered" | cut -d ' ' -f 2-)"
+    rm -f "$DIR"/send*.out "$DIR"/recv*.out
+}
+
+# sessions <count>: short transfers through a fresh pair each, then through one receiver -d
+sessions() {
+    head -n 100 "$INPUT" > "$DIR/small.txt"
+    begin=$(date +%s.%N)
+    for i in $(seq "$1"); do
+        ./receiver -q -r 64 2 > /dev/null & # waits for the sender to post the ring
+        ./sender -q -r 64 2 "$DIR/small.txt" > /dev/null
+        wait
+    done
+    fresh=$(awk "BEGIN { print $(date +%s.%N) - $begin }")
+    ./receiver -q -d 2 > /dev/null &
+    daemon=$!
+    sleep 0.2 # the receiver creates the ring
+    begin=$(date +%s.%N)
+    for i in $(seq "$1"); do
+        ./sender -q -d 2 "$DIR/small.txt" > /dev/null
+    done
+    persistent=$(awk "BEGIN { print $(date +%s.%N) - $begin }")
+    kill "$daemon"
+    wait
+    printf "%s sessions of 100 lines: fresh pairs %s s, persistent receiver %s s\n" "$1" "$fresh" "$persistent"
+}
+
+echo "$LINES lines"
+run "msgqueue fixed"        1 -F
+run "msgqueue"              1
+run "msgqueue batch 8192"   1 -b 8192
+run "mqueue fixed"          3 -F
+run "mqueue"                3
+run "shm fixed"             2 -F
+run "shm"                   2
+run "shm futex"             2 -f
+run "shm futex no spin"     2 -f -s 0
+run "shm ring 64 fixed"     2 -r 64 -F
+run "shm ring 64"           2 -r 64
+run "shm ring 64 stream"    2 -r 64 -m
+run "fifo"                  4
+run "unix seqpacket"        5
+run "eventfd ring 64"       6 -r 64
+run "futex ring 64"         6 -r 64 -f
+if [ -d /dev/hugepages ]; then
+    run "shm ring 64 huge"      2 -r 64 -H
+fi
+
+echo "checksum overhead, $(grep -q sse4_2 /proc/cpuinfo && echo sse4.2 || echo table) CRC32C"
+checked "msgqueue"              1
+checked "msgqueue batch 8192"   1 -b 8192
+checked "mqueue"                3
+checked "shm"                   2
+checked "shm ring 64"           2 -r 64
+checked "shm ring 64 stream"    2 -r 64 -m
+checked "fifo"                  4
+checked "unix seqpacket"        5
+checked "eventfd ring 64"       6 -r 64
+
+echo "${BINARY_MB:=64} MB binary file"
+head -c "$((BINARY_MB << 20))" /dev/urandom > "$DIR/input.bin"
+binary "shm binary 64K"        2 -B 65536
+binary "shm binary 1M"         2 -B 1048576
+binary "shm binary 1M ring 4"  2 -B 1048576 -r 4
+binary "eventfd binary 1M"     6 -B 1048576
+binary "shm binary 1M crc32c"  2 -B 1048576 -c
+
+: "${RTT_SIZES:=8,64,512,4096,16384,65536}" "${RTT_ROUNDS:=10000}"
+echo "round trips, $RTT_ROUNDS per payload size"
+rtt "msgqueue"                 1
+rtt "shm"                      2
+rtt "shm futex"                2 -f
+rtt "shm ring 4"               2 -r 4
+rtt "mqueue"                   3
+rtt "fifo"                     4
+rtt "unix seqpacket"           5
+rtt "eventfd ring"             6
+rtt "futex ring"               6 -f
+
+pinned "ring same cpu"         0
+pinned "ring sibling thread"   "$(cpu_near sibling)"
+pinned "ring other core"       "$(cpu_near core)"
+pinned "ring other socket"     "$(cpu_near socket)"
+
+echo "$LINES lines per sender, $(nproc) cpus"
+for config in "1 1" "2 1" "1 2" "2 2" "4 2" "4 4"; do
+    mpmc $config
+done
+
+sessions 100
+
+rm -rf "$DIR"
@@ -0,0 +1,1085 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/msg.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mailbox.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_index(uint64_t value) {
+    if (value < HIST_SUB)
+        return value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(value >> shift) - HIST_SUB;
+}
+
+// midpoint of the values that land in bucket index
+static uint64_t hist_value(int index) {
+    if (index < HIST_SUB)
+        return index;
+    int shift = index / HIST_SUB - 1;
+    uint64_t low = (uint64_t)(HIST_SUB + index % HIST_SUB) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+/**
+ * Record one message that was stamped by the sender at stamp and is done now.
+ */
+void hist_record(histogram_t* hist, uint64_t stamp, uint64_t bytes) {
+    uint64_t now = now_ns();
+    uint64_t latency = now > stamp ? now - stamp : 0;
+
+    hist->count[hist_index(latency)]++;
+    if (latency > hist->max)
+        hist->max = latency;
+    if (hist->messages == 0 || stamp < hist->first)
+        hist->first = stamp;
+    hist->last = now;
+    hist->messages++;
+    hist->bytes += bytes;
+}
+
+uint64_t hist_percentile(const histogram_t* hist, double percentile) {
+    uint64_t rank = hist->messages * percentile / 100.0;
+    uint64_t seen = 0;
+
+    if (rank >= hist->messages)
+        return hist->max;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += hist->count[i];
+        if (seen > rank)
+            return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+    }
+    return hist->max;
+}
+
+void hist_report(const histogram_t* hist, const char* what) {
+    double seconds = (hist->last - hist->first) * 1e-9;
+
+    if (hist->messages == 0)
+        return;
+    printf("%s latency (us): p50 %.2f  p90 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n", what,
+           hist_percentile(hist, 50) / 1e3, hist_percentile(hist, 90) / 1e3,
+           hist_percentile(hist, 99) / 1e3, hist_percentile(hist, 99.9) / 1e3, hist->max / 1e3);
+    printf("%s throughput: %llu messages in %.6f s, %.0f messages/s, %.2f MB/s\n", what,
+           (unsigned long long)hist->messages, seconds,
+           seconds > 0 ? hist->messages / seconds : 0, seconds > 0 ? hist->bytes / seconds / 1e6 : 0);
+}
+
+void pin_cpu(int cpu) {
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        perror("sched_setaffinity failed");
+        exit(1);
+    }
+}
+
+static int topology_read(int cpu, const char* what) {
+    char path[128];
+    int value = -1;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+    FILE* file = fopen(path, "r");
+    if (file) {
+        if (fscanf(file, "%d", &value) != 1)
+            value = -1;
+        fclose(file);
+    }
+    return value;
+}
+
+/**
+ * Print the cpus the two sides started on and how much of the cache
+ * hierarchy lies between them.
+ */
+void topology_report(const stats_t* stats) {
+    int send = atomic_load_explicit(&stats->send.cpu, memory_order_relaxed);
+    int recv = atomic_load_explicit(&stats->receive.cpu, memory_order_relaxed);
+    int send_core = topology_read(send, "core_id"), send_socket = topology_read(send, "physical_package_id");
+    int recv_core = topology_read(recv, "core_id"), recv_socket = topology_read(recv, "physical_package_id");
+    const char* relation = send == recv                                          ? "same cpu"
+                           : send_socket != recv_socket                          ? "different sockets"
+                           : send_core == recv_core                              ? "sibling hyperthreads"
+                                                                                 : "different cores, same socket";
+
+    printf("topology: send cpu %d (core %d, socket %d), receive cpu %d (core %d, socket %d): %s\n", send, send_core,
+           send_socket, recv, recv_core, recv_socket, relation);
+}
+
+size_t map_size(size_t size, int huge) {
+    return huge ? (size + HUGE_PAGE - 1) & ~(size_t)(HUGE_PAGE - 1) : size;
+}
+
+/**
+ * shm_open, or with huge pages open the file of the same name on the
+ * hugetlbfs mount, since /dev/shm only hands out 4K pages.
+ */
+int segment_open(const char* name, int flags, int huge) {
+    char path[PATH_MAX];
+
+    if (!huge)
+        return shm_open(name, flags, 0666);
+    snprintf(path, sizeof(path), "%s%s", HUGE_DIR, name);
+    return open(path, flags, 0666);
+}
+
+int segment_unlink(const char* name, int huge) {
+    char path[PATH_MAX];
+
+    if (!huge)
+        return shm_unlink(name);
+    snprintf(path, sizeof(path), "%s%s", HUGE_DIR, name);
+    return unlink(path);
+}
+
+/**
+ * Map a ring or queue segment with every page faulted in up front, so
+ * neither side takes page faults or TLB fills for it inside the timed loop.
+ */
+void* segment_map(int fd, size_t size, int huge) {
+    void* addr = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+
+    if (addr == MAP_FAILED) {
+        perror("mmap failed");
+        if (huge)
+            fprintf(stderr, "huge pages need vm.nr_hugepages and hugetlbfs mounted on %s\n", HUGE_DIR);
+        exit(1);
+    }
+    return addr;
+}
+
+/**
+ * Map the /mailbox_stats segment, creating it zeroed if no run has yet.
+ */
+stats_t* stats_map(void) {
+    int fd = shm_open(STATS_NAME, O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+        perror("shm_open failed");
+        exit(1);
+    }
+    // growing a new segment zero-fills it, an existing one keeps its counters
+    if (ftruncate(fd, sizeof(stats_t)) == -1) {
+        perror("ftruncate failed");
+        exit(1);
+    }
+    stats_t* stats = mmap(0, sizeof(stats_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (stats == MAP_FAILED) {
+        perror("mmap failed");
+        exit(1);
+    }
+    close(fd);
+    return stats;
+}
+
+void stats_open(mailbox_t* mailbox_ptr, int sender) {
+    mailbox_ptr->stats = stats_map();
+    mailbox_ptr->side = sender ? &mailbox_ptr->stats->send : &mailbox_ptr->stats->receive;
+    atomic_store_explicit(&mailbox_ptr->stats->flag, mailbox_ptr->flag, memory_order_relaxed);
+    atomic_store_explicit(&mailbox_ptr->side->cpu, sched_getcpu(), memory_order_relaxed);
+    // published before the first message, which the receiver takes after it
+    if (sender)
+        atomic_store_explicit(&mailbox_ptr->stats->checksum, mailbox_ptr->checksum, memory_order_release);
+}
+
+/**
+ * Count one message of this side. Relaxed adds are enough: mbstat only
+ * needs each counter to be exact on its own, not consistent with the others.
+ */
+void stats_record(mailbox_t* mailbox_ptr, uint64_t bytes, uint64_t wait_ns, uint64_t copy_ns) {
+    stats_t* stats = mailbox_ptr->stats;
+    side_stats_t* side = mailbox_ptr->side;
+
+    uint64_t messages = atomic_fetch_add_explicit(&side->messages, 1, memory_order_relaxed) + 1;
+    atomic_fetch_add_explicit(&side->bytes, bytes, memory_order_relaxed);
+    atomic_fetch_add_explicit(&side->wait_ns, wait_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&side->copy_ns, copy_ns, memory_order_relaxed);
+    if (side == &stats->send) {
+        // the receiver may count a message before its sender gets here
+        uint64_t received = atomic_load_explicit(&stats->receive.messages, memory_order_relaxed);
+        uint64_t depth = messages > received ? messages - received : 0;
+        uint64_t max = atomic_load_explicit(&stats->depth_max, memory_order_relaxed);
+        while (depth > max && !atomic_compare_exchange_weak_explicit(&stats->depth_max, &max, depth,
+                                                                     memory_order_relaxed, memory_order_relaxed))
+            ;
+    }
+}
+
+void stats_wait(mailbox_t* mailbox_ptr, uint64_t wait_ns) {
+    atomic_fetch_add_explicit(&mailbox_ptr->side->wait_ns, wait_ns, memory_order_relaxed);
+}
+
+size_t ring_size(uint32_t slots, uint32_t slot_size) {
+    return sizeof(ring_t) + (size_t)slots * slot_size;
+}
+
+void ring_init(ring_t* ring, uint32_t slots, uint32_t slot_size, uint32_t wait) {
+    memset(ring, 0, sizeof(ring_t));
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->wait = wait;
+}
+
+// the segment is shared between processes, so no FUTEX_PRIVATE_FLAG
+static long futex(_Atomic uint32_t* word, int op, uint32_t value, const struct timespec* timeout) {
+    return syscall(SYS_futex, (uint32_t*)word, op, value, timeout, NULL, 0);
+}
+
+/**
+ * Give up the cpu until *index may have moved away from seen.
+ * The flag is raised before the final check of *index, so a side that moves
+ * the index after that check always sees the flag. FUTEX_WAIT repeats the
+ * check in the kernel and returns at once if the index already moved.
+ */
+static void ring_block(mailbox_t* mailbox_ptr, _Atomic uint32_t* waiting, _Atomic uint32_t* index,
+                       uint32_t seen, int fd) {
+    uint64_t value;
+
+    mailbox_ptr->blocked++;
+    atomic_fetch_add_explicit(&mailbox_ptr->side->blocked, 1, memory_order_relaxed);
+    if (mailbox_ptr->wait == RING_WAIT_YIELD) {
+        sched_yield();
+        return;
+    }
+    atomic_store(waiting, 1);
+    if (atomic_load(index) == seen) {
+        if (mailbox_ptr->wait == RING_WAIT_FUTEX) {
+            if (futex(index, FUTEX_WAIT, seen, NULL) == -1 && errno != EAGAIN && errno != EINTR)
+                perror("futex wait failed");
+        } else {
+            while (read(fd, &value, sizeof(value)) == -1 && errno == EINTR)
+                ;
+        }
+    }
+    atomic_store_explicit(waiting, 0, memory_order_relaxed);
+}
+
+static void ring_wake(mailbox_t* mailbox_ptr, _Atomic uint32_t* waiting, _Atomic uint32_t* index, int fd) {
+    uint64_t one = 1;
+
+    if (mailbox_ptr->wait == RING_WAIT_YIELD)
+        return;
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiting, memory_order_relaxed) && atomic_exchange(waiting, 0)) {
+        if (mailbox_ptr->wait == RING_WAIT_FUTEX) {
+            if (futex(index, FUTEX_WAKE, 1, NULL) == -1)
+                perror("futex wake failed");
+        } else if (write(fd, &one, sizeof(one)) == -1) {
+            perror("eventfd write failed");
+        }
+    }
+}
+
+/**
+ * Wait until the sender may fill the slot at head and return it.
+ * Only reads the receiver's tail again once the cached copy says the ring is full.
+ */
+void* ring_reserve(mailbox_t* mailbox_ptr) {
+    ring_t* ring = mailbox_ptr->storage.ring;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    int spins = 0;
+
+    while (head - ring->tail_cache == ring->slots) {
+        ring->tail_cache = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (head - ring->tail_cache != ring->slots)
+            break;
+        if (++spins < mailbox_ptr->spin) {
+            cpu_relax();
+        } else {
+            spins = 0;
+            ring_block(mailbox_ptr, &ring->space_waiting, &ring->tail, ring->tail_cache, mailbox_ptr->space_fd);
+        }
+    }
+    return ring->slot + (size_t)(head & (ring->slots - 1)) * ring->slot_size;
+}
+
+void ring_publish(mailbox_t* mailbox_ptr) {
+    ring_t* ring = mailbox_ptr->storage.ring;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    ring_wake(mailbox_ptr, &ring->data_waiting, &ring->head, mailbox_ptr->data_fd);
+}
+
+/**
+ * Wait until the receiver has a filled slot at tail and return it.
+ */
+void* ring_peek(mailbox_t* mailbox_ptr) {
+    ring_t* ring = mailbox_ptr->storage.ring;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    int spins = 0;
+
+    while (tail == ring->head_cache) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail != ring->head_cache)
+            break;
+        if (++spins < mailbox_ptr->spin) {
+            cpu_relax();
+        } else {
+            spins = 0;
+            ring_block(mailbox_ptr, &ring->data_waiting, &ring->head, tail, mailbox_ptr->data_fd);
+        }
+    }
+    return ring->slot + (size_t)(tail & (ring->slots - 1)) * ring->slot_size;
+}
+
+void ring_release(mailbox_t* mailbox_ptr) {
+    ring_t* ring = mailbox_ptr->storage.ring;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    ring_wake(mailbox_ptr, &ring->space_waiting, &ring->tail, mailbox_ptr->space_fd);
+}
+
+/**
+ * Wait until the receiver has released every published slot, so the sender
+ * does not unlink the segment before a late receiver has attached to it.
+ */
+void ring_drain(ring_t* ring) {
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    int spins = 0;
+
+    while (atomic_load_explicit(&ring->tail, memory_order_acquire) != head) {
+        if (++spins < RING_SPIN) {
+            cpu_relax();
+        } else {
+            spins = 0;
+            sched_yield();
+        }
+    }
+}
+
+/**
+ * Take a persistent ring for one sender session, sleeping while another
+ * sender holds it. A holder that died without detaching is replaced.
+ */
+void ring_attach(ring_t* ring) {
+    const struct timespec poll = { .tv_nsec = 100000000 };
+    uint32_t self = getpid();
+    uint32_t owner = 0;
+
+    while (!atomic_compare_exchange_strong(&ring->session, &owner, self)) {
+        if (kill(owner, 0) == -1 && errno == ESRCH) {
+            fprintf(stderr, "sender %u left the ring without closing its session\n", owner);
+            if (atomic_compare_exchange_strong(&ring->session, &owner, self))
+                break;
+        } else {
+            // wake up now and then to notice a holder that died
+            futex(&ring->session, FUTEX_WAIT, owner, &poll);
+        }
+        owner = 0;
+    }
+}
+
+void ring_detach(ring_t* ring) {
+    atomic_store(&ring->session, 0);
+    if (futex(&ring->session, FUTEX_WAKE, 1, NULL) == -1)
+        perror("futex wake failed");
+}
+
+size_t mpmc_size(uint32_t slots) {
+    return sizeof(mpmc_t) + (size_t)slots * sizeof(mpmc_slot_t);
+}
+
+static void mpmc_wait(mailbox_t* mailbox_ptr, int* spins) {
+    if (++*spins < mailbox_ptr->spin) {
+        cpu_relax();
+    } else {
+        *spins = 0;
+        mailbox_ptr->blocked++;
+        atomic_fetch_add_explicit(&mailbox_ptr->side->blocked, 1, memory_order_relaxed);
+        sched_yield();
+    }
+}
+
+/**
+ * Create the /shm_mpmc queue, or attach to the one another sender or receiver
+ * created, and take the next sender or receiver index.
+ */
+void mpmc_open(mailbox_t* mailbox_ptr, int sender) {
+    size_t size = map_size(mpmc_size(mailbox_ptr->slots), mailbox_ptr->huge);
+    int creator = 1;
+    int fd = segment_open(MPMC_NAME, O_CREAT | O_EXCL | O_RDWR, mailbox_ptr->huge);
+    struct stat st;
+
+    if (fd == -1 && errno == EEXIST) {
+        creator = 0;
+        fd = segment_open(MPMC_NAME, O_RDWR, mailbox_ptr->huge);
+    }
+    if (fd == -1) {
+        perror("shm_open failed");
+        exit(1);
+    }
+    if (creator && ftruncate(fd, size) == -1) {
+        perror("ftruncate failed");
+        exit(1);
+    }
+    // the creator may not have sized the segment yet
+    for (int tries = 0; fstat(fd, &st) == 0 && (size_t)st.st_size != size; ++tries) {
+        if (st.st_size || tries == 1000) {
+            fprintf(stderr, "%s does not hold a queue of %u slots\n", MPMC_NAME, mailbox_ptr->slots);
+            exit(1);
+        }
+        usleep(10000);
+    }
+    mpmc_t* queue = segment_map(fd, size, mailbox_ptr->huge);
+    close(fd);
+
+    if (creator) {
+        queue->slots = mailbox_ptr->slots;
+        queue->producers = mailbox_ptr->producers;
+        queue->consumers = mailbox_ptr->consumers;
+        for (uint32_t i = 0; i < queue->slots; ++i)
+            atomic_init(&queue->slot[i].turn, i);
+        atomic_store_explicit(&queue->ready, 1, memory_order_release);
+    }
+    while (!atomic_load_explicit(&queue->ready, memory_order_acquire))
+        sched_yield();
+    if (queue->producers != mailbox_ptr->producers || queue->consumers != mailbox_ptr->consumers) {
+        fprintf(stderr, "%s is shared by %u senders and %u receivers\n", MPMC_NAME, queue->producers, queue->consumers);
+        exit(1);
+    }
+
+    uint32_t limit = sender ? queue->producers : queue->consumers;
+    mailbox_ptr->id = atomic_fetch_add(sender ? &queue->producers_joined : &queue->consumers_joined, 1);
+    if (mailbox_ptr->id >= limit) {
+        fprintf(stderr, "%s already has %u %s, remove /dev/shm%s if it is left over\n", MPMC_NAME, limit,
+                sender ? "senders" : "receivers", MPMC_NAME);
+        exit(1);
+    }
+    mailbox_ptr->storage.mpmc = queue;
+    mailbox_ptr->mapped = size;
+}
+
+/**
+ * Claim the next free position for this sender and return its slot.
+ */
+mpmc_slot_t* mpmc_reserve(mailbox_t* mailbox_ptr) {
+    mpmc_t* queue = mailbox_ptr->storage.mpmc;
+    uint32_t pos = atomic_load_explicit(&queue->enqueue, memory_order_relaxed);
+    int spins = 0;
+
+    for (;;) {
+        mpmc_slot_t* slot = &queue->slot[pos & (queue->slots - 1)];
+        int32_t diff = atomic_load_explicit(&slot->turn, memory_order_acquire) - pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueue, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                mailbox_ptr->position = pos;
+                return slot;
+            }
+        } else {
+            // full when the slot is still a lap behind, otherwise another sender took pos
+            if (diff < 0)
+                mpmc_wait(mailbox_ptr, &spins);
+            pos = atomic_load_explicit(&queue->enqueue, memory_order_relaxed);
+        }
+    }
+}
+
+void mpmc_publish(mailbox_t* mailbox_ptr, mpmc_slot_t* slot) {
+    atomic_store_explicit(&slot->turn, mailbox_ptr->position + 1, memory_order_release);
+}
+
+/**
+ * Claim the next filled position for this receiver and return its slot.
+ */
+mpmc_slot_t* mpmc_peek(mailbox_t* mailbox_ptr) {
+    mpmc_t* queue = mailbox_ptr->storage.mpmc;
+    uint32_t pos = atomic_load_explicit(&queue->dequeue, memory_order_relaxed);
+    int spins = 0;
+
+    for (;;) {
+        mpmc_slot_t* slot = &queue->slot[pos & (queue->slots - 1)];
+        int32_t diff = atomic_load_explicit(&slot->turn, memory_order_acquire) - (pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeue, &pos, pos + 1, memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                mailbox_ptr->position = pos;
+                return slot;
+            }
+        } else {
+            if (diff < 0)
+                mpmc_wait(mailbox_ptr, &spins);
+            pos = atomic_load_explicit(&queue->dequeue, memory_order_relaxed);
+        }
+    }
+}
+
+void mpmc_release(mailbox_t* mailbox_ptr, mpmc_slot_t* slot) {
+    atomic_store_explicit(&slot->turn, mailbox_ptr->position + mailbox_ptr->storage.mpmc->slots,
+                          memory_order_release);
+}
+
+/**
+ * Record how many messages this sender queued. The last sender to finish
+ * queues one end marker per receiver behind every line of every sender, and
+ * counts them as sent since every receiver counts the one it takes.
+ */
+void mpmc_finish(mailbox_t* mailbox_ptr) {
+    mpmc_t* queue = mailbox_ptr->storage.mpmc;
+
+    atomic_store(&queue->sent[mailbox_ptr->id], mailbox_ptr->sequence);
+    if (atomic_fetch_add(&queue->producers_done, 1) + 1 != queue->producers)
+        return;
+    for (uint32_t i = 0; i < queue->consumers; ++i) {
+        mpmc_slot_t* slot = mpmc_reserve(mailbox_ptr);
+        slot->producer = MPMC_MAX;
+        slot->message.mtype = MTYPE_END;
+        slot->message.stamp = now_ns();
+        slot->message.mlen = 0;
+        mpmc_publish(mailbox_ptr, slot);
+        stats_record(mailbox_ptr, 0, 0, 0);
+    }
+}
+
+/**
+ * Add this receiver's counts to the queue totals. The last receiver to leave
+ * checks every sender's messages arrived, reports the aggregate throughput
+ * and removes the queue.
+ */
+void mpmc_leave(mailbox_t* mailbox_ptr, const histogram_t* hist, const uint64_t* received, uint64_t reordered) {
+    mpmc_t* queue = mailbox_ptr->storage.mpmc;
+
+    if (hist->messages) {
+        uint64_t first = atomic_load(&queue->first);
+        while ((first == 0 || hist->first < first) && !atomic_compare_exchange_weak(&queue->first, &first, hist->first))
+            ;
+        uint64_t last = atomic_load(&queue->last);
+        while (hist->last > last && !atomic_compare_exchange_weak(&queue->last, &last, hist->last))
+            ;
+    }
+    atomic_fetch_add(&queue->messages, hist->messages);
+    atomic_fetch_add(&queue->bytes, hist->bytes);
+    atomic_fetch_add(&queue->reordered, reordered);
+    for (uint32_t i = 0; i < queue->producers; ++i)
+        atomic_fetch_add(&queue->received[i], received[i]);
+
+    if (atomic_fetch_add(&queue->consumers_done, 1) + 1 == queue->consumers) {
+        uint64_t sent = 0, lost = 0;
+        double seconds = (queue->last - queue->first) * 1e-9;
+        for (uint32_t i = 0; i < queue->producers; ++i) {
+            sent += queue->sent[i];
+            if (queue->received[i] != queue->sent[i]) {
+                fprintf(stderr, "sender %u queued %llu messages, %llu arrived\n", i,
+                        (unsigned long long)queue->sent[i], (unsigned long long)queue->received[i]);
+                lost += queue->sent[i] > queue->received[i] ? queue->sent[i] - queue->received[i] : 0;
+            }
+        }
+        printf("aggregate delivered %llu of %llu messages, %llu lost, %llu out of order\n",
+               (unsigned long long)queue->messages, (unsigned long long)sent, (unsigned long long)lost,
+               (unsigned long long)queue->reordered);
+        printf("aggregate throughput: %u senders, %u receivers, %llu messages in %.6f s, %.0f messages/s, %.2f MB/s\n",
+               queue->producers, queue->consumers, (unsigned long long)queue->messages, seconds,
+               seconds > 0 ? queue->messages / seconds : 0, seconds > 0 ? queue->bytes / seconds / 1e6 : 0);
+        segment_unlink(MPMC_NAME, mailbox_ptr->huge);
+    }
+    munmap(queue, mailbox_ptr->mapped);
+}
+
+/*
+ * Ping-pong mode: frames go out through the mailbox the run set up and come
+ * back through a reverse one of the same method. The System V queue carries
+ * both directions, told apart by mtype, and so does the unix socket. The
+ * single shm slot holds the ping and then the pong, handed over by the two
+ * semaphores. A ring gets a second ring behind it in the same segment, and
+ * reuses the eventfds the other way round. The POSIX queue and the FIFO get
+ * a second one of their own.
+ */
+void ping_open(const mailbox_t* mailbox_ptr, mailbox_t* back, int sender) {
+    *back = *mailbox_ptr;
+    back->reader = NULL;
+    if (mailbox_is_ring(mailbox_ptr)) {
+        ring_t* ring = mailbox_ptr->storage.ring;
+        back->storage.ring = (ring_t*)((char*)ring + ring_size(ring->slots, ring->slot_size));
+        back->data_fd = mailbox_ptr->space_fd;
+        back->space_fd = mailbox_ptr->data_fd;
+    } else if (mailbox_ptr->flag == 3) {
+        struct mq_attr attr;
+        if (mq_getattr(mailbox_ptr->storage.mqd, &attr) == -1) {
+            perror("mq_getattr failed");
+            exit(1);
+        }
+        attr.mq_flags = 0;
+        back->storage.mqd = mq_open(MQ_PONG_NAME, O_CREAT | (sender ? O_RDONLY : O_WRONLY), 0666, &attr);
+        if (back->storage.mqd == (mqd_t)-1) {
+            perror("mq_open failed");
+            exit(1);
+        }
+    } else if (mailbox_ptr->flag == 4) {
+        if (mkfifo(FIFO_PONG_NAME, 0666) == -1 && errno != EEXIST) {
+            perror("mkfifo failed");
+            exit(1);
+        }
+        // the sender opened the forward FIFO first, so both sides get here in the same order
+        if (sender) {
+            back->reader = malloc(sizeof(reader_t));
+            if (!back->reader) {
+                perror("malloc failed");
+                exit(1);
+            }
+            back->reader->pos = back->reader->len = 0;
+            back->reader->fd = open(FIFO_PONG_NAME, O_RDONLY);
+            if (back->reader->fd == -1) {
+                perror("open failed");
+                exit(1);
+            }
+        } else {
+            back->storage.fd = open(FIFO_PONG_NAME, O_WRONLY);
+            if (back->storage.fd == -1) {
+                perror("open failed");
+                exit(1);
+            }
+        }
+    }
+}
+
+void ping_close(mailbox_t* back, int sender) {
+    if (back->flag == 3) {
+        mq_close(back->storage.mqd);
+        if (!sender)
+            mq_unlink(MQ_PONG_NAME);
+    } else if (back->flag == 4 && sender) {
+        close(back->reader->fd);
+        free(back->reader);
+    } else if (back->flag == 4) {
+        close(back->storage.fd);
+        unlink(FIFO_PONG_NAME);
+    }
+}
+
+/**
+ * Largest System V message, header included, that msgsnd accepts.
+ */
+long kernel_msgmax(void) {
+    FILE* file = fopen("/proc/sys/kernel/msgmax", "r");
+    long msgmax = 8192;
+
+    if (file) {
+        if (fscanf(file, "%ld", &msgmax) != 1)
+            msgmax = 8192;
+        fclose(file);
+    }
+    return msgmax;
+}
+
+/**
+ * Largest POSIX message an unprivileged mq_open may ask for.
+ */
+long mqueue_msgsize_max(void) {
+    FILE* file = fopen("/proc/sys/fs/mqueue/msgsize_max", "r");
+    long msgsize_max = 8192;
+
+    if (file) {
+        if (fscanf(file, "%ld", &msgsize_max) != 1)
+            msgsize_max = 8192;
+        fclose(file);
+    }
+    return msgsize_max;
+}
+
+/**
+ * Largest payload the method carries in one frame, at most PING_MAX.
+ */
+size_t ping_limit(const mailbox_t* mailbox_ptr) {
+    long limit = PING_MAX;
+
+    if (mailbox_is_ring(mailbox_ptr)) {
+        limit = mailbox_ptr->storage.ring->slot_size - sizeof(chunk_t);
+    } else if (mailbox_ptr->flag == 1) {
+        limit = kernel_msgmax() - (long)MSG_HDR;
+    } else if (mailbox_ptr->flag == 3) {
+        struct mq_attr attr;
+        if (mq_getattr(mailbox_ptr->storage.mqd, &attr) == 0)
+            limit = attr.mq_msgsize - (long)MSG_HDR;
+    }
+    return limit < PING_MAX ? limit : PING_MAX;
+}
+
+void ping_put(mailbox_t* mailbox_ptr, const ping_t* frame) {
+    size_t size = MSG_HDR + frame->mlen;
+
+    if (mailbox_is_ring(mailbox_ptr)) {
+        chunk_t* slot = ring_reserve(mailbox_ptr);
+        slot->stamp = frame->stamp;
+        slot->length = frame->mlen;
+        memcpy(slot->data, frame->mtext, frame->mlen);
+        ring_publish(mailbox_ptr);
+    } else if (mailbox_ptr->flag == 1) {
+        if (msgsnd(mailbox_ptr->storage.msqid, frame, size, 0) == -1) {
+            perror("msgsnd failed");
+            exit(1);
+        }
+    } else if (mailbox_ptr->flag == 2) {
+        memcpy(mailbox_ptr->storage.shm_addr, frame, sizeof(ping_t) + frame->mlen);
+        sem_post(mailbox_ptr->full_sem);
+    } else if (mailbox_ptr->flag == 3) {
+        if (mq_send(mailbox_ptr->storage.mqd, MSG_BODY(frame), size, 0) == -1) {
+            perror("mq_send failed");
+            exit(1);
+        }
+    } else if (write_full(mailbox_ptr->storage.fd, MSG_BODY(frame), size) == -1) {
+        perror("write failed");
+        exit(1);
+    }
+}
+
+/**
+ * Wait for the next frame of type mtype and copy it into frame, which holds
+ * PING_MAX bytes of payload.
+ */
+void ping_get(mailbox_t* mailbox_ptr, ping_t* frame, long mtype) {
+    if (mailbox_is_ring(mailbox_ptr)) {
+        chunk_t* slot = ring_peek(mailbox_ptr);
+        frame->mtype = mtype;
+        frame->stamp = slot->stamp;
+        frame->mlen = slot->length;
+        memcpy(frame->mtext, slot->data, slot->length);
+        ring_release(mailbox_ptr);
+    } else if (mailbox_ptr->flag == 1) {
+        if (msgrcv(mailbox_ptr->storage.msqid, frame, MSG_HDR + PING_MAX, mtype, 0) == -1) {
+            perror("msgrcv failed");
+            exit(1);
+        }
+    } else if (mailbox_ptr->flag == 2) {
+        const ping_t* slot = (const ping_t*)mailbox_ptr->storage.shm_addr;
+        while (sem_wait(mailbox_ptr->full_sem) == -1 && errno == EINTR)
+            ;
+        memcpy(frame, slot, sizeof(ping_t) + slot->mlen);
+    } else if (mailbox_ptr->flag == 3) {
+        if (mq_receive(mailbox_ptr->storage.mqd, MSG_BODY(frame), MSG_HDR + PING_MAX, NULL) == -1) {
+            perror("mq_receive failed");
+            exit(1);
+        }
+    } else if (mailbox_ptr->flag == 4) {
+        int ok = reader_read(mailbox_ptr->reader, MSG_BODY(frame), MSG_HDR);
+        if (ok > 0 && frame->mlen > PING_MAX) {
+            fprintf(stderr, "frame of %u bytes does not fit\n", frame->mlen);
+            exit(1);
+        }
+        if (ok > 0)
+            ok = reader_read(mailbox_ptr->reader, frame->mtext, frame->mlen);
+        if (ok <= 0) {
+            fprintf(stderr, "read failed: %s\n", ok ? strerror(errno) : "the other side closed the FIFO");
+            exit(1);
+        }
+    } else {
+        ssize_t length = recv(mailbox_ptr->storage.fd, MSG_BODY(frame), MSG_HDR + PING_MAX, 0);
+        if (length <= 0) {
+            fprintf(stderr, "recv failed: %s\n", length ? strerror(errno) : "the other side closed the socket");
+            exit(1);
+        }
+    }
+}
+
+/*
+ * CRC32C (Castagnoli, reflected polynomial 0x82f63b78), the checksum the
+ * SSE4.2 crc32 instruction computes. Without the instruction a slice-by-8
+ * table does eight bytes per step. crc32c_init picks one for the process.
+ */
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t crc32c_slice(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* p = data;
+
+    crc = ~crc;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; length && ((uintptr_t)p & 7); --length)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    for (; length >= 8; length -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+    }
+#endif
+    for (; length; --length)
+        crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void* data, size_t length) {
+    const unsigned char* p = data;
+    uint64_t value = ~crc;
+
+    for (; length && ((uintptr_t)p & 7); --length)
+        value = _mm_crc32_u8(value, *p++);
+    for (; length >= 8; length -= 8, p += 8)
+        value = _mm_crc32_u64(value, *(const uint64_t*)p);
+    for (; length; --length)
+        value = _mm_crc32_u8(value, *p++);
+    return ~(uint32_t)value;
+}
+#endif
+
+static uint32_t (*crc32c_impl)(uint32_t, const void*, size_t) = crc32c_slice;
+
+const char* crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; ++bit)
+            crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; ++i)
+        for (int k = 1; k < 8; ++k)
+            crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xff];
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_impl = crc32c_sse42;
+        return "sse4.2";
+    }
+#endif
+    crc32c_impl = crc32c_slice;
+    return "table";
+}
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    return crc32c_impl(crc, data, length);
+}
+
+/**
+ * Read until buf holds length bytes or the file ends. Returns the bytes read,
+ * fewer than length only at end of file, or -1 on error.
+ */
+ssize_t read_full(int fd, void* buf, size_t length) {
+    char* p = buf;
+
+    while (length) {
+        ssize_t n = read(fd, p, length);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (n == 0)
+            break;
+        p += n;
+        length -= n;
+    }
+    return p - (char*)buf;
+}
+
+int write_full(int fd, const void* buf, size_t length) {
+    const char* p = buf;
+
+    while (length) {
+        ssize_t n = write(fd, p, length);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += n;
+        length -= n;
+    }
+    return 0;
+}
+
+/**
+ * Copy exactly length bytes out of the reader, refilling its buffer with
+ * large reads. Returns 0 at end of file and -1 on error.
+ */
+int reader_read(reader_t* reader, void* buf, size_t length) {
+    char* p = buf;
+
+    while (length) {
+        if (reader->pos == reader->len) {
+            ssize_t n = read(reader->fd, reader->buf, sizeof(reader->buf));
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return n;
+            reader->pos = 0;
+            reader->len = n;
+        }
+        size_t chunk = reader->len - reader->pos < length ? reader->len - reader->pos : length;
+        memcpy(p, reader->buf + reader->pos, chunk);
+        reader->pos += chunk;
+        p += chunk;
+        length -= chunk;
+    }
+    return 1;
+}
+
+/**
+ * Queue length bytes at data for output. stable says data stays valid until
+ * the next flush, otherwise it is copied. Returns -1 if a flush failed.
+ */
+int writer_add(writer_t* writer, const char* data, size_t length, int stable) {
+    if (length == 0)
+        return 0;
+    if (writer->count == WRITER_IOV || (!stable && writer->used + length > sizeof(writer->buf))) {
+        if (writer_flush(writer) == -1)
+            return -1;
+    }
+    if (!stable) {
+        memcpy(writer->buf + writer->used, data, length);
+        data = writer->buf + writer->used;
+        writer->used += length;
+    }
+    struct iovec* last = writer->count ? &writer->iov[writer->count - 1] : NULL;
+    if (last && (char*)last->iov_base + last->iov_len == data) {
+        last->iov_len += length;
+    } else {
+        writer->iov[writer->count].iov_base = (char*)data;
+        writer->iov[writer->count].iov_len = length;
+        writer->count++;
+    }
+    return 0;
+}
+
+int writer_flush(writer_t* writer) {
+    struct iovec* iov = writer->iov;
+    int count = writer->count;
+
+    while (count) {
+        ssize_t n = writev(writer->fd, iov, count);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // step over what a short write took
+        while (count && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    writer->count = 0;
+    writer->used = 0;
+    return 0;
+}
+
+/**
+ * Accept one SOCK_SEQPACKET connection on path and return it.
+ */
+int mailbox_listen(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+    if (sock == -1 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(sock, 1) == -1) {
+        perror("listen failed");
+        exit(1);
+    }
+    int conn = accept(sock, NULL, NULL);
+    if (conn == -1) {
+        perror("accept failed");
+        exit(1);
+    }
+    close(sock);
+    unlink(path);
+    return conn;
+}
+
+/**
+ * Connect to the receiver listening on path, waiting up to 10 s for it to start.
+ */
+int mailbox_connect(const char* path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (sock == -1) {
+        perror("socket failed");
+        exit(1);
+    }
+    for (int tries = 0; connect(sock, (struct sockaddr*)&addr, sizeof(addr)) == -1; ++tries) {
+        if ((errno != ENOENT && errno != ECONNREFUSED) || tries == 1000) {
+            perror("connect failed");
+            exit(1);
+        }
+        usleep(10000);
+    }
+    return sock;
+}
+
+void send_fds(int sock, const int* fds, int count) {
+    char data = 0;
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * 4)];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+    if (sendmsg(sock, &msg, 0) == -1) {
+        perror("sendmsg failed");
+        exit(1);
+    }
+}
+
+void recv_fds(int sock, int* fds, int count) {
+    char data;
+    struct iovec iov = { .iov_base = &data, .iov_len = 1 };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * 4)];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = CMSG_SPACE(sizeof(int) * count),
+    };
+
+    if (recvmsg(sock, &msg, 0) == -1) {
+        perror("recvmsg failed");
+        exit(1);
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(int) * count)) {
+        fprintf(stderr, "sender did not pass the ring descriptors\n");
+        exit(1);
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * count);
+}
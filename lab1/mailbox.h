@@ -0,0 +1,348 @@
+#ifndef MAILBOX_H
+#define MAILBOX_H
+
+#include <limits.h>
+#include <mqueue.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#define SHM_NAME "/shm_comm"
+#define MQ_NAME "/mq_comm"
+#define FIFO_NAME "/tmp/mailbox.fifo"
+#define MQ_PONG_NAME "/mq_pong"                  // reverse mailboxes of the ping-pong mode
+#define FIFO_PONG_NAME "/tmp/mailbox.pong.fifo"
+#define SOCK_NAME "/tmp/mailbox.sock"
+#define MPMC_NAME "/shm_mpmc"
+#define STATS_NAME "/mailbox_stats"
+#define HUGE_DIR "/dev/hugepages"  // hugetlbfs mount that holds the segments with -H
+#define HUGE_PAGE (2 << 20)
+#define RING_SLOTS 64   // ring size of method 6 when -r is not given
+#define CACHE_LINE 64
+#define RING_SPIN 1024  // default busy polls before a ring side gives up its cpu
+
+#define MTYPE_LINE 1   // mtext holds a single line
+#define MTYPE_BATCH 2  // mtext holds NUL-terminated lines back to back
+#define MTYPE_END 3    // the transfer is over; the frame is empty, mlen 0
+#define MTYPE_OPEN 4   // a sender session on the persistent ring starts, mtext names its input
+#define MTYPE_CLOSE 5  // the sender session on the persistent ring is over
+#define MTYPE_PING 6   // ping-pong frame on its way to the receiver
+#define MTYPE_PONG 7   // the same frame echoed back to the sender
+
+typedef struct {
+    long mtype;
+    uint64_t stamp;      // CLOCK_MONOTONIC ns when the sender had the message ready
+    uint32_t mlen;       // bytes of mtext in use, including the terminating NUL
+    uint32_t crc;        // CRC32C of those bytes with -c
+    char mtext[2000];
+} message_t;
+
+// System V message carrying a batch of lines, sized at run time
+typedef struct {
+    long mtype;
+    uint64_t stamp;
+    uint32_t mlen;
+    uint32_t crc;
+    char mtext[];
+} batch_t;
+
+// msgsnd/msgrcv sizes count from the end of mtype, so add this to mlen
+#define MSG_HDR (offsetof(message_t, mtext) - sizeof(long))
+// what goes on the wire for byte-oriented transports: the message minus mtype
+#define MSG_BODY(m) ((char*)(m) + sizeof(long))
+
+// Frame of the ping-pong mode: a message_t header ahead of up to PING_MAX bytes
+typedef struct {
+    long mtype;       // MTYPE_PING or MTYPE_PONG
+    uint64_t stamp;   // CLOCK_MONOTONIC ns when the sender sent the ping, echoed unchanged
+    uint32_t mlen;    // bytes of payload, 0 ends the run
+    uint32_t crc;
+    char mtext[];
+} ping_t;
+
+_Static_assert(offsetof(ping_t, mtext) == offsetof(message_t, mtext), "MSG_HDR covers the ping_t header");
+
+#define PING_MAX (1 << 16)  // largest ping-pong payload
+#define PING_WARMUP 100     // untimed round trips ahead of each payload size
+
+// Line of the streamed input file, consumed in place from the shared mapping
+typedef struct {
+    uint64_t offset;  // start of the line in the file
+    uint64_t stamp;   // CLOCK_MONOTONIC ns when the sender published the line
+    uint32_t length;  // bytes including the newline, 0 ends the stream
+    uint32_t crc;     // CRC32C of the line as the sender read it, with -c
+} line_t;
+
+// Slot of the binary transfer: the next bytes of the file, whatever they hold
+typedef struct {
+    uint64_t stamp;   // CLOCK_MONOTONIC ns when the sender had the chunk read
+    uint32_t length;  // bytes of data in use
+    uint32_t flags;   // CHUNK_END on the last chunk, kept apart from the data
+    uint32_t crc;     // CRC32C of the data with -c
+    _Alignas(CACHE_LINE) char data[];
+} chunk_t;
+
+#define CHUNK_END 1
+#define CHUNK_MAX (1 << 30)  // largest -B
+
+/*
+ * Single-producer / single-consumer ring kept in the /shm_comm segment.
+ * head is only written by the sender and tail only by the receiver, each on
+ * its own cache line together with that side's cached view of the other index,
+ * so neither side touches the other's line until it runs out of room or data.
+ * A side that is still out of room or data after mailbox_t.spin polls either
+ * yields, or sets its *_waiting flag and sleeps until the other side sees the
+ * flag and signals it, on an eventfd or with a futex on the index word itself.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint32_t head;  // next slot the sender fills
+    uint32_t tail_cache;                         // sender's last seen tail
+    _Alignas(CACHE_LINE) _Atomic uint32_t tail;  // next slot the receiver drains
+    uint32_t head_cache;                         // receiver's last seen head
+    _Alignas(CACHE_LINE) _Atomic uint32_t data_waiting;  // receiver sleeps until head moves
+    _Atomic uint32_t space_waiting;              // sender sleeps until tail moves
+    _Alignas(CACHE_LINE) uint32_t slots;         // power of two
+    uint32_t slot_size;                          // message_t, or line_t when streaming
+    uint32_t wait;                               // RING_WAIT_* both sides use
+    uint32_t persistent;                         // owned by a receiver that outlives its senders
+    _Atomic uint32_t session;                    // pid of the sender attached to a persistent ring
+    uint64_t stream_size;                        // bytes of the streamed input file
+    char stream_path[PATH_MAX];                  // input file both sides map when streaming
+    _Alignas(CACHE_LINE) char slot[];
+} ring_t;
+
+#define RING_WAIT_YIELD 0    // spin, then sched_yield
+#define RING_WAIT_EVENTFD 1  // spin, then sleep in read() on an eventfd
+#define RING_WAIT_FUTEX 2    // spin, then sleep in FUTEX_WAIT on head or tail
+
+/*
+ * Bounded multi-producer / multi-consumer queue in the /shm_mpmc segment, in
+ * the style of Vyukov's array queue: senders claim positions by advancing
+ * enqueue and receivers by advancing dequeue with a compare-and-swap, and the
+ * turn word of each slot says whose turn it is. A slot at position pos is free
+ * for a sender when turn == pos and filled for a receiver when turn == pos + 1;
+ * the receiver hands it to the next lap with turn = pos + slots.
+ * Whichever process comes first creates the segment; the last receiver out
+ * reports the totals and unlinks it.
+ */
+#define MPMC_MAX 64  // most senders one queue accounts for
+
+typedef struct {
+    _Atomic uint32_t turn;
+    uint32_t producer;   // index of the sender, MPMC_MAX for the end marker
+    uint64_t sequence;   // per sender message number, from 0
+    message_t message;
+} mpmc_slot_t;
+
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint32_t enqueue;  // next position a sender claims
+    _Alignas(CACHE_LINE) _Atomic uint32_t dequeue;  // next position a receiver claims
+    _Alignas(CACHE_LINE) _Atomic uint32_t ready;    // creator finished initialising
+    uint32_t slots;                                 // power of two
+    uint32_t producers;                             // senders the receivers wait for
+    uint32_t consumers;                             // receivers that each take one end marker
+    _Atomic uint32_t producers_joined, producers_done;
+    _Atomic uint32_t consumers_joined, consumers_done;
+    _Atomic uint64_t first, last;                   // earliest stamp and latest receive of any receiver
+    _Atomic uint64_t messages, bytes, reordered;    // summed over the receivers
+    _Atomic uint64_t sent[MPMC_MAX];
+    _Atomic uint64_t received[MPMC_MAX];
+    _Alignas(CACHE_LINE) mpmc_slot_t slot[];
+} mpmc_t;
+
+/*
+ * Counters of one side in the /mailbox_stats segment. They only ever grow,
+ * across runs, so mbstat can turn two samples into rates. Wait time is spent
+ * on the other side: semaphore handoffs and ring or queue polls. Copy time is
+ * spent moving bytes in or out of the transport, which for the kernel
+ * transports is the whole system call, blocking included.
+ */
+typedef struct {
+    _Alignas(CACHE_LINE) _Atomic uint64_t messages;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t wait_ns;
+    _Atomic uint64_t copy_ns;
+    _Atomic uint64_t blocked;  // times the side gave up its cpu waiting on a ring or queue
+    _Atomic int32_t cpu;       // cpu the side last started a transfer on
+} side_stats_t;
+
+typedef struct {
+    _Atomic uint32_t flag;          // method of the last run to attach
+    _Atomic uint32_t checksum;      // whether the last sender to attach stamps CRC32C
+    side_stats_t send;
+    side_stats_t receive;
+    _Alignas(CACHE_LINE) _Atomic uint64_t depth_max;  // most messages sent but not yet received
+} stats_t;
+
+// buffered reader for the byte stream transports
+typedef struct {
+    int fd;
+    size_t pos, len;
+    char buf[1 << 16];
+} reader_t;
+
+#define WRITER_IOV 1024       // iovecs per writev, the kernel's UIO_MAXIOV
+#define WRITER_BUF (1 << 20)  // copies of payloads that do not stay in place
+
+/*
+ * Buffered output of the receiver's payloads. Payloads that stay mapped, the
+ * lines of a streamed file, are written from where they are; the others are
+ * copied into buf. Runs that are adjacent in memory share one iovec.
+ */
+typedef struct {
+    int fd;
+    int count;      // iovecs in use
+    size_t used;    // bytes of buf in use
+    struct iovec iov[WRITER_IOV];
+    char buf[WRITER_BUF];
+} writer_t;
+
+typedef struct {
+    int flag;      // 1 for message passing, 2 for shared memory, 3 for POSIX mqueue,
+                   // 4 for FIFO, 5 for unix socket, 6 for shared memory ring with eventfd,
+                   // 7 for shared memory queue between several senders and receivers
+    union {
+        int msqid;      // ID for message queue
+        char* shm_addr; // Share memory address
+        ring_t* ring;   // Share memory ring (flag 2 with slots > 0, flag 6)
+        mpmc_t* mpmc;   // Share memory queue of several senders and receivers
+        mqd_t mqd;      // POSIX message queue descriptor
+        int fd;         // FIFO or socket
+    } storage;
+    int wait;       // RING_WAIT_* for the ring
+    int spin;       // polls of the other side's index before blocking
+    uint64_t blocked; // times this side went to sleep waiting on the ring
+    int cpu;             // cpu this process is pinned to, -1 to let the scheduler place it
+    int huge;            // back the ring or queue with huge pages from HUGE_DIR
+    size_t mapped;       // bytes mapped for the ring or queue
+    stats_t* stats;      // live counters shared with mbstat
+    side_stats_t* side;  // this process's half of stats
+    int data_fd;    // eventfd the sender signals when the receiver waits for data
+    int space_fd;   // eventfd the receiver signals when the sender waits for room
+    reader_t* reader; // receiving end of the FIFO
+    writer_t* writer; // receiver's bulk output of the payloads, NULL to echo them
+    int quiet;        // do not echo every message
+    int checksum;     // the sender stamps a CRC32C on every payload and the receiver checks it
+    uint64_t checked; // payloads the receiver verified
+    uint64_t corrupt; // payloads whose CRC32C did not match
+    uint32_t slots; // 0 for the single-slot semaphore handoff
+    size_t batch;   // msgsnd size of a batch for method 1, 0 sends line by line
+    int fixed;      // copy the whole mtext like the original fixed-size framing
+    int stream;     // ring carries line_t descriptors into the mapped input file
+    int persistent; // the receiver keeps the ring mapped across sender sessions
+    uint32_t chunk; // bytes per chunk_t of a binary transfer, 0 to send lines
+    int ping;       // echo frames back through a reverse mailbox to time round trips
+    sem_t* full_sem; // posted once the single shm slot holds a frame for this direction
+    const char* stream_addr; // mapping of the streamed input file
+    long mq_maxmsg;          // queue depth for method 3
+    long mq_msgsize;         // largest message for method 3, header included
+    unsigned int priority;   // mq_send priority of data messages for method 3
+    uint32_t producers;      // senders sharing the method 7 queue
+    uint32_t consumers;      // receivers sharing the method 7 queue
+    uint32_t id;             // this process's sender or receiver index for method 7
+    uint32_t position;       // queue position of the slot this process holds
+    uint64_t sequence;       // messages this sender has queued so far
+} mailbox_t;
+
+/*
+ * Log-bucketed latency histogram in the style of HdrHistogram: each power of
+ * two range of nanoseconds is split into HIST_SUB linear buckets, so any
+ * recorded value is reported within 1/HIST_SUB of its true value.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    uint64_t count[HIST_BUCKETS];
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t max;
+    uint64_t first; // earliest stamp, where throughput is measured from
+    uint64_t last;  // time of the last record
+} histogram_t;
+
+uint64_t now_ns(void);
+void hist_record(histogram_t* hist, uint64_t stamp, uint64_t bytes);
+void hist_report(const histogram_t* hist, const char* what);
+uint64_t hist_percentile(const histogram_t* hist, double percentile);
+
+void pin_cpu(int cpu);
+void topology_report(const stats_t* stats);
+size_t map_size(size_t size, int huge);
+int segment_open(const char* name, int flags, int huge);
+int segment_unlink(const char* name, int huge);
+void* segment_map(int fd, size_t size, int huge);
+
+stats_t* stats_map(void);
+void stats_open(mailbox_t* mailbox_ptr, int sender);
+void stats_record(mailbox_t* mailbox_ptr, uint64_t bytes, uint64_t wait_ns, uint64_t copy_ns);
+void stats_wait(mailbox_t* mailbox_ptr, uint64_t wait_ns);
+
+static inline uint64_t timespec_ns(const struct timespec* ts) {
+    return (uint64_t)ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
+
+size_t ring_size(uint32_t slots, uint32_t slot_size);
+void ring_init(ring_t* ring, uint32_t slots, uint32_t slot_size, uint32_t wait);
+void* ring_reserve(mailbox_t* mailbox_ptr);
+void ring_publish(mailbox_t* mailbox_ptr);
+void* ring_peek(mailbox_t* mailbox_ptr);
+void ring_release(mailbox_t* mailbox_ptr);
+void ring_drain(ring_t* ring);
+void ring_attach(ring_t* ring);
+void ring_detach(ring_t* ring);
+
+size_t mpmc_size(uint32_t slots);
+void mpmc_open(mailbox_t* mailbox_ptr, int sender);
+mpmc_slot_t* mpmc_reserve(mailbox_t* mailbox_ptr);
+void mpmc_publish(mailbox_t* mailbox_ptr, mpmc_slot_t* slot);
+mpmc_slot_t* mpmc_peek(mailbox_t* mailbox_ptr);
+void mpmc_release(mailbox_t* mailbox_ptr, mpmc_slot_t* slot);
+void mpmc_finish(mailbox_t* mailbox_ptr);
+void mpmc_leave(mailbox_t* mailbox_ptr, const histogram_t* hist, const uint64_t* received, uint64_t reordered);
+
+static inline int mailbox_is_ring(const mailbox_t* mailbox_ptr) {
+    return (mailbox_ptr->flag == 2 && mailbox_ptr->slots) || mailbox_ptr->flag == 6;
+}
+
+// whether every message needs the /sender_sem, /receiver_sem handshake
+static inline int mailbox_is_lockstep(const mailbox_t* mailbox_ptr) {
+    return mailbox_ptr->flag == 1 || (mailbox_ptr->flag == 2 && !mailbox_ptr->slots);
+}
+
+static inline uint32_t chunk_slot_size(uint32_t chunk) {
+    return (sizeof(chunk_t) + chunk + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+}
+
+// what each ring slot holds: a chunk_t, a line_t or a message_t
+static inline uint32_t mailbox_slot_size(const mailbox_t* mailbox_ptr) {
+    return mailbox_ptr->chunk ? chunk_slot_size(mailbox_ptr->chunk)
+           : mailbox_ptr->stream ? sizeof(line_t) : sizeof(message_t);
+}
+
+void ping_open(const mailbox_t* mailbox_ptr, mailbox_t* back, int sender);
+void ping_close(mailbox_t* back, int sender);
+long kernel_msgmax(void);
+long mqueue_msgsize_max(void);
+size_t ping_limit(const mailbox_t* mailbox_ptr);
+void ping_put(mailbox_t* mailbox_ptr, const ping_t* frame);
+void ping_get(mailbox_t* mailbox_ptr, ping_t* frame, long mtype);
+
+const char* crc32c_init(void);
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+ssize_t read_full(int fd, void* buf, size_t length);
+int write_full(int fd, const void* buf, size_t length);
+int reader_read(reader_t* reader, void* buf, size_t length);
+int writer_add(writer_t* writer, const char* data, size_t length, int stable);
+int writer_flush(writer_t* writer);
+int mailbox_listen(const char* path);
+int mailbox_connect(const char* path);
+void send_fds(int sock, const int* fds, int count);
+void recv_fds(int sock, int* fds, int count);
+
+#endif
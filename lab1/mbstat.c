@@ -0,0 +1,121 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "mailbox.h"
+
+// plain copy of one side's counters, taken at a sample
+typedef struct {
+    uint64_t messages, bytes, wait_ns, copy_ns, blocked;
+} side_sample_t;
+
+static void sample(const side_stats_t* side, side_sample_t* out) {
+    out->messages = atomic_load_explicit(&side->messages, memory_order_relaxed);
+    out->bytes = atomic_load_explicit(&side->bytes, memory_order_relaxed);
+    out->wait_ns = atomic_load_explicit(&side->wait_ns, memory_order_relaxed);
+    out->copy_ns = atomic_load_explicit(&side->copy_ns, memory_order_relaxed);
+    out->blocked = atomic_load_explicit(&side->blocked, memory_order_relaxed);
+}
+
+static void zero(side_stats_t* side) {
+    atomic_store(&side->messages, 0);
+    atomic_store(&side->bytes, 0);
+    atomic_store(&side->wait_ns, 0);
+    atomic_store(&side->copy_ns, 0);
+    atomic_store(&side->blocked, 0);
+}
+
+/**
+ * Name the side that holds the transfer back over the last interval: a side
+ * that spends most of its time waiting on the other is not the limit.
+ */
+static const char* limit(double send_wait, double recv_wait) {
+    if (recv_wait > 0.5 && recv_wait > send_wait)
+        return "producer";
+    if (send_wait > 0.5)
+        return "consumer";
+    return "transport";
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-i ms] [-n count] [-z]\n", prog);
+    fprintf(stderr, "  -i ms     sampling interval (default 1000)\n");
+    fprintf(stderr, "  -n count  stop after this many samples\n");
+    fprintf(stderr, "  -z        zero the counters and exit\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    long interval = 1000;
+    long count = -1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:n:z")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = strtol(optarg, NULL, 0);
+            if (interval <= 0) {
+                fprintf(stderr, "interval must be positive\n");
+                exit(1);
+            }
+            break;
+        case 'n':
+            count = strtol(optarg, NULL, 0);
+            break;
+        case 'z': {
+            stats_t* stats = stats_map();
+            zero(&stats->send);
+            zero(&stats->receive);
+            atomic_store(&stats->depth_max, 0);
+            return 0;
+        }
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+
+    stats_t* stats = stats_map();
+    side_sample_t send, recv, last_send, last_recv;
+    const struct timespec pause = { .tv_sec = interval / 1000, .tv_nsec = interval % 1000 * 1000000 };
+    uint64_t last = now_ns();
+
+    sample(&stats->send, &last_send);
+    sample(&stats->receive, &last_recv);
+    for (long i = 0; count < 0 || i < count; ++i) {
+        if (i % 20 == 0)
+            printf("%6s %10s %10s %8s %7s %7s %6s %6s %6s %6s %8s %8s  %s\n", "method", "sent/s", "recv/s", "MB/s",
+                   "depth", "max", "s.wait", "s.copy", "r.wait", "r.copy", "s.block", "r.block", "limit");
+        nanosleep(&pause, NULL);
+        uint64_t now = now_ns();
+        double seconds = (now - last) * 1e-9;
+        sample(&stats->send, &send);
+        sample(&stats->receive, &recv);
+
+        // shares of the interval each side spent waiting on the other and copying
+        double send_wait = (send.wait_ns - last_send.wait_ns) * 1e-9 / seconds;
+        double recv_wait = (recv.wait_ns - last_recv.wait_ns) * 1e-9 / seconds;
+        printf("%6u %10.0f %10.0f %8.2f %7llu %7llu %5.1f%% %5.1f%% %5.1f%% %5.1f%% %8llu %8llu  %s\n",
+               atomic_load_explicit(&stats->flag, memory_order_relaxed),
+               (send.messages - last_send.messages) / seconds, (recv.messages - last_recv.messages) / seconds,
+               (recv.bytes - last_recv.bytes) / seconds / 1e6,
+               (unsigned long long)(send.messages > recv.messages ? send.messages - recv.messages : 0),
+               (unsigned long long)atomic_load_explicit(&stats->depth_max, memory_order_relaxed),
+               100 * send_wait, (send.copy_ns - last_send.copy_ns) * 1e-7 / seconds,
+               100 * recv_wait, (recv.copy_ns - last_recv.copy_ns) * 1e-7 / seconds,
+               (unsigned long long)(send.blocked - last_send.blocked),
+               (unsigned long long)(recv.blocked - last_recv.blocked),
+               send.messages == last_send.messages && recv.messages == last_recv.messages ? "idle"
+                                                                                        : limit(send_wait, recv_wait));
+        fflush(stdout);
+        last = now;
+        last_send = send;
+        last_recv = recv;
+    }
+    munmap(stats, sizeof(stats_t));
+    return 0;
+}
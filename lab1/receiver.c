@@ -1,62 +1,511 @@
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ipc.h>
 #include <sys/msg.h>
 #include <semaphore.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <time.h>
 
-typedef struct {
-    long mtype;
-    char mtext[2000];
-} message_t;
-
-typedef struct {
-    int flag;      // 1 for message passing, 2 for shared memory
-    union {
-        int msqid;
-        char* shm_addr;
-    } storage;
-} mailbox_t;
-
+#include "mailbox.h"
 
 struct timespec start, end;
 double time_taken;
+histogram_t hist;  // per message sender-to-receiver latency
+uint64_t received[MPMC_MAX];       // method 7 messages taken from each sender
+uint64_t next_sequence[MPMC_MAX];  // lowest sequence number each sender may still deliver
+uint64_t reordered;                // messages that arrived behind a later one of the same sender
+const char* crc_impl;              // CRC32C implementation in use with -c
+uint64_t unstamped;                // payloads that came from a sender without -c
+
+/**
+ * Check a payload against the CRC32C the sender stamped on it. A mismatch is
+ * counted, not fatal: the payload is delivered either way. A sender without
+ * -c leaves the field unset, so its payloads are skipped instead.
+ */
+static void verify(mailbox_t* mailbox_ptr, const void* data, size_t length, uint32_t crc) {
+    if (!atomic_load_explicit(&mailbox_ptr->stats->checksum, memory_order_acquire)) {
+        if (!unstamped++)
+            fprintf(stderr, "the sender does not stamp checksums, its payloads are not verified\n");
+        return;
+    }
+    mailbox_ptr->checked++;
+    if (crc32c(0, data, length) != crc)
+        mailbox_ptr->corrupt++;
+}
 
 void receive_message(message_t* message_ptr, mailbox_t* mailbox_ptr) {
+    uint64_t ready = 0; // when the ring or queue had data, the copy starts there
+
     if (mailbox_ptr->flag == 1) {
 	    clock_gettime(CLOCK_MONOTONIC, &start);
-        if (msgrcv(mailbox_ptr->storage.msqid, message_ptr, sizeof(message_ptr->mtext), 0, 0) == -1) {
+        if (msgrcv(mailbox_ptr->storage.msqid, message_ptr, MSG_HDR + sizeof(message_ptr->mtext), 0, 0) == -1) {
             perror("msgrcv failed");
             exit(1);
         }
 	clock_gettime(CLOCK_MONOTONIC, &end);
 	time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    } else if (mailbox_is_ring(mailbox_ptr)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        message_t* slot = ring_peek(mailbox_ptr);
+        ready = now_ns();
+        message_ptr->mtype = slot->mtype;
+        message_ptr->stamp = slot->stamp;
+        message_ptr->mlen = slot->mlen;
+        message_ptr->crc = slot->crc;
+        if (mailbox_ptr->fixed) {
+            strcpy(message_ptr->mtext, slot->mtext);
+        } else {
+            memcpy(message_ptr->mtext, slot->mtext, slot->mlen);
+        }
+        ring_release(mailbox_ptr);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    } else if (mailbox_ptr->flag == 7) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        mpmc_slot_t* slot = mpmc_peek(mailbox_ptr);
+        ready = now_ns();
+        message_ptr->mtype = slot->message.mtype;
+        message_ptr->stamp = slot->message.stamp;
+        message_ptr->mlen = slot->message.mlen;
+        message_ptr->crc = slot->message.crc;
+        if (mailbox_ptr->fixed) {
+            strcpy(message_ptr->mtext, slot->message.mtext);
+        } else {
+            memcpy(message_ptr->mtext, slot->message.mtext, slot->message.mlen);
+        }
+        // one receiver sees a subset of each sender's lines, but always in order
+        if (slot->producer < MPMC_MAX) {
+            received[slot->producer]++;
+            if (slot->sequence < next_sequence[slot->producer])
+                reordered++;
+            else
+                next_sequence[slot->producer] = slot->sequence + 1;
+        }
+        mpmc_release(mailbox_ptr, slot);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
     } else if (mailbox_ptr->flag == 2) {
 	clock_gettime(CLOCK_MONOTONIC, &start);
-        strcpy(message_ptr->mtext, mailbox_ptr->storage.shm_addr);
+        message_t* slot = (message_t*)mailbox_ptr->storage.shm_addr;
+        message_ptr->mtype = slot->mtype;
+        message_ptr->stamp = slot->stamp;
+        message_ptr->mlen = slot->mlen;
+        message_ptr->crc = slot->crc;
+        if (mailbox_ptr->fixed) {
+            strcpy(message_ptr->mtext, slot->mtext);
+        } else {
+            memcpy(message_ptr->mtext, slot->mtext, slot->mlen);
+        }
     	clock_gettime(CLOCK_MONOTONIC, &end);
     	time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    } else if (mailbox_ptr->flag == 3) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (mq_receive(mailbox_ptr->storage.mqd, MSG_BODY(message_ptr), MSG_HDR + sizeof(message_ptr->mtext), NULL) == -1) {
+            perror("mq_receive failed");
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    } else if (mailbox_ptr->flag == 4) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        int ok = reader_read(mailbox_ptr->reader, MSG_BODY(message_ptr), MSG_HDR);
+        if (ok > 0) {
+            if (message_ptr->mlen > sizeof(message_ptr->mtext)) {
+                fprintf(stderr, "message of %u bytes does not fit\n", message_ptr->mlen);
+                exit(1);
+            }
+            ok = reader_read(mailbox_ptr->reader, message_ptr->mtext,
+                             mailbox_ptr->fixed ? sizeof(message_ptr->mtext) : message_ptr->mlen);
+        }
+        if (ok <= 0) {
+            fprintf(stderr, "read failed: %s\n", ok ? strerror(errno) : "sender closed the FIFO");
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    } else if (mailbox_ptr->flag == 5) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        ssize_t length = recv(mailbox_ptr->storage.fd, MSG_BODY(message_ptr), MSG_HDR + sizeof(message_ptr->mtext), 0);
+        if (length <= 0) {
+            fprintf(stderr, "recv failed: %s\n", length ? strerror(errno) : "sender closed the socket");
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
     } else {
         printf("Unknown communication method\n");
         exit(1);
     }
+    // the end frame carries no payload, and the one from mpmc_finish no checksum;
+    // mlen travels on every method, unlike mtype
+    if (mailbox_ptr->checksum && message_ptr->mlen != 0)
+        verify(mailbox_ptr, message_ptr->mtext, message_ptr->mlen, message_ptr->crc);
+    uint64_t begin = timespec_ns(&start);
+    stats_record(mailbox_ptr, message_ptr->mlen, ready ? ready - begin : 0, timespec_ns(&end) - (ready ? ready : begin));
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <communication method>\n", argv[0]);
+// sem_wait of the lockstep handoff, counted as time waiting for the sender
+static void lockstep_wait(sem_t* sem, mailbox_t* mailbox_ptr) {
+    uint64_t begin = now_ns();
+    sem_wait(sem);
+    stats_wait(mailbox_ptr, now_ns() - begin);
+}
+
+/**
+ * Receive one System V message of up to mailbox_ptr->batch bytes.
+ * Returns the number of bytes of mtext holding lines.
+ */
+size_t receive_batch(batch_t* batch, mailbox_t* mailbox_ptr) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (msgrcv(mailbox_ptr->storage.msqid, batch, mailbox_ptr->batch, 0, 0) == -1) {
+        perror("msgrcv failed");
         exit(1);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    stats_record(mailbox_ptr, batch->mlen, 0, timespec_ns(&end) - timespec_ns(&start));
+    if (mailbox_ptr->checksum)
+        verify(mailbox_ptr, batch->mtext, batch->mlen, batch->crc);
 
-    int method = atoi(argv[1]);
-    mailbox_t mailbox;
+    return batch->mlen;
+}
+
+void receive_line(line_t* line, mailbox_t* mailbox_ptr) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    line_t* slot = ring_peek(mailbox_ptr);
+    uint64_t ready = now_ns();
+    *line = *slot;
+    ring_release(mailbox_ptr);
+    if (mailbox_ptr->checksum && line->length)
+        verify(mailbox_ptr, mailbox_ptr->stream_addr + line->offset, line->length, line->crc);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    stats_record(mailbox_ptr, line->length, ready - timespec_ns(&start), timespec_ns(&end) - ready);
+}
+
+/**
+ * Take one chunk of a binary transfer and write it to the output straight
+ * from its slot, before the slot goes back to the sender.
+ */
+void receive_chunk(chunk_t* info, mailbox_t* mailbox_ptr) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    chunk_t* chunk = ring_peek(mailbox_ptr);
+    uint64_t ready = now_ns();
+    if (mailbox_ptr->checksum)
+        verify(mailbox_ptr, chunk->data, chunk->length, chunk->crc);
+    if (mailbox_ptr->writer && write_full(mailbox_ptr->writer->fd, chunk->data, chunk->length) == -1) {
+        perror("write failed");
+        exit(1);
+    }
+    info->stamp = chunk->stamp;
+    info->length = chunk->length;
+    info->flags = chunk->flags;
+    ring_release(mailbox_ptr);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    stats_record(mailbox_ptr, info->length, ready - timespec_ns(&start), timespec_ns(&end) - ready);
+}
+
+/**
+ * Send every frame straight back through the reverse mailbox until the empty
+ * one that ends the run. Returns the frames echoed.
+ */
+uint64_t pong_run(mailbox_t* mailbox_ptr, mailbox_t* back) {
+    ping_t* frame = malloc(sizeof(ping_t) + PING_MAX);
+    uint64_t echoed = 0;
+
+    if (!frame) {
+        perror("malloc failed");
+        exit(1);
+    }
+    while (1) {
+        ping_get(mailbox_ptr, frame, MTYPE_PING);
+        if (frame->mlen == 0)
+            break;
+        frame->mtype = MTYPE_PONG;
+        ping_put(back, frame);
+        echoed++;
+    }
+    free(frame);
+    return echoed;
+}
+
+/**
+ * Hand one payload to the bulk output, or echo it unless quiet.
+ * stable payloads stay mapped until the output is flushed.
+ */
+static void deliver(mailbox_t* mailbox_ptr, const char* data, size_t length, int stable) {
+    if (mailbox_ptr->writer) {
+        if (writer_add(mailbox_ptr->writer, data, length, stable) == -1) {
+            perror("writev failed");
+            exit(1);
+        }
+    } else if (!mailbox_ptr->quiet) {
+        printf("\033[32mReceived: %.*s\033[0m", (int)length, data);
+    }
+}
+
+static void deliver_flush(mailbox_t* mailbox_ptr) {
+    if (mailbox_ptr->writer && writer_flush(mailbox_ptr->writer) == -1) {
+        perror("writev failed");
+        exit(1);
+    }
+}
+
+static void checksum_report(const mailbox_t* mailbox_ptr) {
+    if (crc_impl)
+        printf("checksums: %llu payloads verified with CRC32C (%s), %llu corrupt\n",
+               (unsigned long long)mailbox_ptr->checked, crc_impl, (unsigned long long)mailbox_ptr->corrupt);
+    if (unstamped)
+        printf("checksums: %llu payloads arrived without one\n", (unsigned long long)unstamped);
+}
+
+/**
+ * Report the session that just ended on the persistent ring the way a single
+ * run reports at exit, and start counting the next one from zero.
+ */
+static void session_report(mailbox_t* mailbox_ptr) {
+    deliver_flush(mailbox_ptr);
+    printf("\nTotal time taken in receiving msg: %f seconds\n", time_taken);
+    hist_report(&hist, "receive");
+    printf("receive blocked %llu times waiting for data\n", (unsigned long long)mailbox_ptr->blocked);
+    topology_report(mailbox_ptr->stats);
+    checksum_report(mailbox_ptr);
+    fflush(stdout);
+    time_taken = 0;
+    memset(&hist, 0, sizeof(hist));
+    mailbox_ptr->blocked = 0;
+    mailbox_ptr->checked = mailbox_ptr->corrupt = 0;
+    unstamped = 0;
+}
+
+// a persistent receiver runs until it is killed, so it removes its names here
+static int persistent_huge;
+static void stop_persistent(int sig) {
+    segment_unlink(SHM_NAME, persistent_huge);
+    sem_unlink("/sender_sem");
+    sem_unlink("/receiver_sem");
+    _exit(0);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-q] [-c] [-o file] [-r slots] [-f] [-s spins] [-d] [-a cpu] [-H] [-m] [-b bytes] [-B bytes] [-F] [-M count] [-S bytes]\n"
+                    "          [-P senders] [-C receivers] [-R] <communication method>\n", prog);
+    fprintf(stderr, "  -q        do not echo the received lines\n");
+    fprintf(stderr, "  -c        verify the CRC32C the sender's -c stamped on every payload\n");
+    fprintf(stderr, "  -o file   write the received payloads to file, - for stdout, with large writev calls;\n"
+                    "            the reports then go to stderr if file is stdout\n");
+    fprintf(stderr, "  -r slots  attach to the sender's shared memory ring (method 2, 6)\n");
+    fprintf(stderr, "  -f        attach to a ring that sleeps on a futex, as the sender's -f\n");
+    fprintf(stderr, "  -s spins  polls of the sender's index before blocking (default %d)\n", RING_SPIN);
+    fprintf(stderr, "  -d        own the ring and keep serving sender sessions until killed (method 2)\n");
+    fprintf(stderr, "  -a cpu    pin the receiver to this cpu\n");
+    fprintf(stderr, "  -H        find the ring or queue on " HUGE_DIR ", as the sender's -H (method 2, 7)\n");
+    fprintf(stderr, "  -m        read lines in place from the sender's mapped input file\n");
+    fprintf(stderr, "  -b bytes  receive batches of up to this many bytes (method 1)\n");
+    fprintf(stderr, "  -B bytes  receive a binary transfer in chunks of this size, as the sender's -B;\n"
+                    "            the data goes to -o file, or is only counted (method 2, 6)\n");
+    fprintf(stderr, "  -F        fixed-size framing: copy shared memory messages with strcpy\n");
+    fprintf(stderr, "  -M count  POSIX queue depth if the receiver creates it (method 3)\n");
+    fprintf(stderr, "  -S bytes  POSIX queue message size if the receiver creates it (method 3)\n");
+    fprintf(stderr, "  -P count  senders sharing the queue (method 7)\n");
+    fprintf(stderr, "  -C count  receivers sharing the queue; the last one out reports the totals (method 7)\n");
+    fprintf(stderr, "  -R        echo every frame of a sender started with -R back to it (method 1 to 6)\n");
+    fprintf(stderr, "methods: 1 System V msgqueue, 2 shared memory, 3 POSIX mqueue, 4 FIFO,\n"
+                    "         5 unix seqpacket socket, 6 shared memory ring with eventfd,\n"
+                    "         7 shared memory queue of several senders and receivers\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    mailbox_t mailbox = { .spin = RING_SPIN, .producers = 1, .consumers = 1, .cpu = -1 };
+    const char* output = NULL;
     message_t message;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "qco:r:fs:da:Hmb:B:FM:S:P:C:R")) != -1) {
+        switch (opt) {
+        case 'q':
+            mailbox.quiet = 1;
+            break;
+        case 'c':
+            mailbox.checksum = 1;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'r':
+            mailbox.slots = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            mailbox.wait = RING_WAIT_FUTEX;
+            break;
+        case 's':
+            mailbox.spin = strtol(optarg, NULL, 0);
+            break;
+        case 'd':
+            mailbox.persistent = 1;
+            break;
+        case 'a':
+            mailbox.cpu = strtol(optarg, NULL, 0);
+            break;
+        case 'H':
+            mailbox.huge = 1;
+            break;
+        case 'm':
+            mailbox.stream = 1;
+            break;
+        case 'b':
+            mailbox.batch = strtoul(optarg, NULL, 0);
+            if (mailbox.batch < MSG_HDR + sizeof(message.mtext)) {
+                fprintf(stderr, "batch must hold at least one line (%zu bytes)\n", MSG_HDR + sizeof(message.mtext));
+                exit(1);
+            }
+            break;
+        case 'B':
+            mailbox.chunk = strtoul(optarg, NULL, 0);
+            if (mailbox.chunk == 0 || mailbox.chunk > CHUNK_MAX) {
+                fprintf(stderr, "chunks must be between 1 and %d bytes\n", CHUNK_MAX);
+                exit(1);
+            }
+            break;
+        case 'F':
+            mailbox.fixed = 1;
+            break;
+        case 'M':
+            mailbox.mq_maxmsg = strtol(optarg, NULL, 0);
+            break;
+        case 'S':
+            mailbox.mq_msgsize = strtol(optarg, NULL, 0);
+            // a line fragment needs a character and its NUL
+            if (mailbox.mq_msgsize < (long)MSG_HDR + 2 || mailbox.mq_msgsize > (long)(MSG_HDR + PING_MAX)) {
+                fprintf(stderr, "message size must be between %zu and %zu bytes\n", MSG_HDR + 2, MSG_HDR + PING_MAX);
+                exit(1);
+            }
+            break;
+        case 'P':
+            mailbox.producers = strtoul(optarg, NULL, 0);
+            break;
+        case 'C':
+            mailbox.consumers = strtoul(optarg, NULL, 0);
+            break;
+        case 'R':
+            mailbox.ping = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+        usage(argv[0]);
+
+    int method = atoi(argv[optind]);
     mailbox.flag = method;
+    if (mailbox.batch && mailbox.flag != 1) {
+        fprintf(stderr, "batching needs method 1\n");
+        exit(1);
+    }
+    if (mailbox.wait == RING_WAIT_FUTEX && mailbox.flag != 2 && mailbox.flag != 6) {
+        fprintf(stderr, "futex waiting needs method 2 or 6\n");
+        exit(1);
+    }
+    if (mailbox.ping) {
+        if (mailbox.flag < 1 || mailbox.flag > 6 || mailbox.stream || mailbox.batch || mailbox.chunk ||
+            mailbox.persistent) {
+            fprintf(stderr, "round trips need method 1 to 6 without -m, -b, -B or -d\n");
+            exit(1);
+        }
+        // one frame is in flight at a time
+        if (mailbox.flag == 6 && !mailbox.slots)
+            mailbox.slots = 2;
+        // the sizes are the sender's to pick, so a queue made here holds the largest it may ask for
+        if (mailbox.flag == 3 && !mailbox.mq_msgsize) {
+            long msgsize_max = mqueue_msgsize_max();
+            mailbox.mq_msgsize = (long)(MSG_HDR + PING_MAX) < msgsize_max ? (long)(MSG_HDR + PING_MAX) : msgsize_max;
+        }
+    } else if (mailbox.mq_msgsize > (long)(MSG_HDR + sizeof(message.mtext))) {
+        fprintf(stderr, "message size above %zu bytes needs -R\n", MSG_HDR + sizeof(message.mtext));
+        exit(1);
+    }
+    if (mailbox.chunk) {
+        if ((mailbox.flag != 2 && mailbox.flag != 6) || mailbox.stream || mailbox.persistent) {
+            fprintf(stderr, "binary transfer needs method 2 or 6 without -m or -d\n");
+            exit(1);
+        }
+        // double buffering: the sender fills one chunk while the receiver drains the other
+        if (!mailbox.slots)
+            mailbox.slots = 2;
+    }
+    if (mailbox.persistent) {
+        if (mailbox.flag != 2 || mailbox.stream) {
+            fprintf(stderr, "a persistent receiver serves method 2 without streaming\n");
+            exit(1);
+        }
+        // sleep on the futex between sessions instead of yielding forever
+        mailbox.wait = RING_WAIT_FUTEX;
+        if (!mailbox.slots)
+            mailbox.slots = RING_SLOTS;
+    }
+    if (mailbox.flag == 6) {
+        if (mailbox.wait != RING_WAIT_FUTEX)
+            mailbox.wait = RING_WAIT_EVENTFD;
+        if (!mailbox.slots)
+            mailbox.slots = RING_SLOTS;
+    }
+    if (mailbox.flag == 7) {
+        if (!mailbox.slots)
+            mailbox.slots = RING_SLOTS;
+        if (mailbox.producers == 0 || mailbox.producers > MPMC_MAX || mailbox.consumers == 0) {
+            fprintf(stderr, "the queue needs 1 to %d senders and at least one receiver\n", MPMC_MAX);
+            exit(1);
+        }
+    }
+    // a one slot ring is the semaphore handoff with a futex on head and tail
+    if (mailbox.wait == RING_WAIT_FUTEX && !mailbox.slots)
+        mailbox.slots = 1;
+    if (mailbox.stream && !mailbox_is_ring(&mailbox)) {
+        fprintf(stderr, "streaming needs method 2 with a ring (-r) or method 6\n");
+        exit(1);
+    }
+    if (mailbox.huge && !mailbox_is_ring(&mailbox) && mailbox.flag != 7) {
+        fprintf(stderr, "huge pages need a ring or the method 7 queue\n");
+        exit(1);
+    }
+    if (mailbox.cpu >= 0)
+        pin_cpu(mailbox.cpu);
+    if (output) {
+        mailbox.writer = malloc(sizeof(writer_t));
+        if (!mailbox.writer) {
+            perror("malloc failed");
+            exit(1);
+        }
+        mailbox.writer->count = 0;
+        mailbox.writer->used = 0;
+        if (strcmp(output, "-") == 0) {
+            // keep the payloads alone on stdout and move the reports to stderr
+            mailbox.writer->fd = dup(STDOUT_FILENO);
+            dup2(STDERR_FILENO, STDOUT_FILENO);
+        } else {
+            mailbox.writer->fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        }
+        if (mailbox.writer->fd == -1) {
+            perror(output);
+            exit(1);
+        }
+    }
+    // the ring replaces the per message semaphore handshake, the other transports block on their own
+    int lockstep = mailbox_is_lockstep(&mailbox);
+
+    if (mailbox.checksum)
+        crc_impl = crc32c_init();
+    stats_open(&mailbox, 0);
 
     sem_t *sender_sem = sem_open("/sender_sem", O_CREAT, 0644, 0);
     sem_t *receiver_sem = sem_open("/receiver_sem", O_CREAT, 0644, 0);
@@ -77,13 +526,130 @@ int main(int argc, char* argv[]) {
             perror("msgget failed");
             exit(1);
         }
+    } else if (mailbox.persistent) {
+        // set up once; senders attach to this ring for one session each
+        int shm_fd = segment_open(SHM_NAME, O_CREAT | O_RDWR, mailbox.huge);
+        if (shm_fd == -1) {
+            perror("shm_open failed");
+            exit(1);
+        }
+        mailbox.mapped = map_size(ring_size(mailbox.slots, sizeof(message_t)), mailbox.huge);
+        if (ftruncate(shm_fd, mailbox.mapped) == -1) {
+            perror("ftruncate failed");
+            exit(1);
+        }
+        mailbox.storage.ring = segment_map(shm_fd, mailbox.mapped, mailbox.huge);
+        close(shm_fd);
+        ring_init(mailbox.storage.ring, mailbox.slots, sizeof(message_t), mailbox.wait);
+        mailbox.storage.ring->persistent = 1;
+        persistent_huge = mailbox.huge;
+        signal(SIGINT, stop_persistent);
+        signal(SIGTERM, stop_persistent);
+    } else if (mailbox_is_ring(&mailbox)) {
+        int shm_fd;
+        if (mailbox.flag == 6) {
+            // the sender connects and passes the ring memfd and both eventfds
+            int sock = mailbox_listen(SOCK_NAME);
+            int fds[3];
+            recv_fds(sock, fds, 3);
+            close(sock);
+            shm_fd = fds[0];
+            mailbox.data_fd = fds[1];
+            mailbox.space_fd = fds[2];
+        } else {
+            sem_wait(receiver_sem); // sender posts once the ring is initialised
+            shm_fd = segment_open(SHM_NAME, O_RDWR, mailbox.huge);
+        }
+        if (shm_fd == -1) {
+            perror("shm_open failed");
+            exit(1);
+        }
+        struct stat st;
+        if (fstat(shm_fd, &st) == -1) {
+            perror("fstat failed");
+            exit(1);
+        }
+        mailbox.storage.ring = segment_map(shm_fd, st.st_size, mailbox.huge);
+        mailbox.mapped = st.st_size;
+        close(shm_fd);
+        ring_t* ring = mailbox.storage.ring;
+        if (ring->slots != mailbox.slots) {
+            fprintf(stderr, "sender ring has %u slots\n", ring->slots);
+            exit(1);
+        }
+        // the sender sizes the slots of a ping-pong ring for its largest payload
+        if (!mailbox.ping && ring->slot_size != mailbox_slot_size(&mailbox)) {
+            fprintf(stderr, "sender ring holds slots of %u bytes\n", ring->slot_size);
+            exit(1);
+        }
+        if (ring->wait != (uint32_t)mailbox.wait) {
+            fprintf(stderr, "sender ring %s on a futex\n", mailbox.wait == RING_WAIT_FUTEX ? "does not wait" : "waits");
+            exit(1);
+        }
+
+        if (mailbox.stream && ring->stream_size) {
+            int fd = open(ring->stream_path, O_RDONLY);
+            if (fd == -1) {
+                perror(ring->stream_path);
+                exit(1);
+            }
+            mailbox.stream_addr = mmap(0, ring->stream_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+            if (mailbox.stream_addr == MAP_FAILED) {
+                perror("mmap failed");
+                exit(1);
+            }
+            madvise((void*)mailbox.stream_addr, ring->stream_size, MADV_SEQUENTIAL);
+            close(fd);
+        }
+    } else if (mailbox.flag == 3) {
+        struct mq_attr attr = {
+            .mq_maxmsg = mailbox.mq_maxmsg ? mailbox.mq_maxmsg : 10,
+            .mq_msgsize = mailbox.mq_msgsize ? mailbox.mq_msgsize : MSG_HDR + sizeof(message.mtext),
+        };
+        mailbox.storage.mqd = mq_open(MQ_NAME, O_CREAT | O_RDONLY, 0666, &attr);
+        if (mailbox.storage.mqd == (mqd_t)-1) {
+            perror("mq_open failed");
+            if (errno == EINVAL)
+                fprintf(stderr, "queue limits are capped by fs.mqueue.msg_max and fs.mqueue.msgsize_max\n");
+            exit(1);
+        }
+        if (mq_getattr(mailbox.storage.mqd, &attr) == -1) {
+            perror("mq_getattr failed");
+            exit(1);
+        }
+        if (attr.mq_msgsize > (long)(MSG_HDR + (mailbox.ping ? PING_MAX : sizeof(message.mtext)))) {
+            fprintf(stderr, "%s holds messages of %ld bytes, more than a message_t\n", MQ_NAME, attr.mq_msgsize);
+            exit(1);
+        }
+    } else if (mailbox.flag == 4) {
+        if (mkfifo(FIFO_NAME, 0666) == -1 && errno != EEXIST) {
+            perror("mkfifo failed");
+            exit(1);
+        }
+        mailbox.reader = malloc(sizeof(reader_t));
+        if (!mailbox.reader) {
+            perror("malloc failed");
+            exit(1);
+        }
+        mailbox.reader->pos = mailbox.reader->len = 0;
+        mailbox.reader->fd = open(FIFO_NAME, O_RDONLY); // waits for the sender to open its end
+        if (mailbox.reader->fd == -1) {
+            perror("open failed");
+            exit(1);
+        }
+    } else if (mailbox.flag == 5) {
+        mailbox.storage.fd = mailbox_listen(SOCK_NAME);
+    } else if (mailbox.flag == 7) {
+        mpmc_open(&mailbox, 0);
     } else if (mailbox.flag == 2) {
-        int shm_fd = shm_open("/shm_comm", O_RDWR, 0666);
+        int shm_fd = shm_open(SHM_NAME, O_RDWR, 0666);
         if (shm_fd == -1) {
             perror("shm_open failed");
             exit(1);
         }
-        mailbox.storage.shm_addr = mmap(0, sizeof(message_t), PROT_READ, MAP_SHARED, shm_fd, 0);
+        mailbox.mapped = mailbox.ping ? sizeof(ping_t) + PING_MAX : sizeof(message_t);
+        mailbox.storage.shm_addr = mmap(0, mailbox.mapped, PROT_READ | (mailbox.ping ? PROT_WRITE : 0),
+                                        MAP_SHARED | MAP_POPULATE, shm_fd, 0);
         if (mailbox.storage.shm_addr == MAP_FAILED) {
             perror("mmap failed");
             exit(1);
@@ -92,22 +658,112 @@ int main(int argc, char* argv[]) {
 
 
 
-    while (1) {
-        sem_wait(receiver_sem); 
+    batch_t* batch = NULL;
+    if (mailbox.batch && !(batch = malloc(sizeof(batch_t) + mailbox.batch))) {
+        perror("malloc failed");
+        exit(1);
+    }
 
-        receive_message(&message, &mailbox);
+    if (mailbox.ping) {
+        mailbox_t back;
+        ping_open(&mailbox, &back, 0);
+        mailbox.full_sem = receiver_sem;
+        back.full_sem = sender_sem;
+        printf("echoed %llu frames\n", (unsigned long long)pong_run(&mailbox, &back));
+        ping_close(&back, 0);
+    } else {
+        while (1) {
+            if (lockstep) lockstep_wait(receiver_sem, &mailbox);
 
-        if (strcmp(message.mtext, "exit") == 0) {
-            break;
+            if (mailbox.chunk) {
+                chunk_t chunk;
+                receive_chunk(&chunk, &mailbox);
+                hist_record(&hist, chunk.stamp, chunk.length);
+                if (chunk.flags & CHUNK_END) {
+                    break;
+                }
+            } else if (mailbox.stream) {
+                line_t line;
+                receive_line(&line, &mailbox);
+                if (line.length == 0) {
+                    break;
+                }
+                deliver(&mailbox, mailbox.stream_addr + line.offset, line.length, 1);
+                hist_record(&hist, line.stamp, line.length);
+            } else if (batch) {
+                size_t length = receive_batch(batch, &mailbox);
+                if (length == 0) {
+                    break;
+                }
+                // a batch is stamped once, when the sender flushed it
+                for (char* line = batch->mtext; line < batch->mtext + length; line += strlen(line) + 1) {
+                    deliver(&mailbox, line, strlen(line), 0);
+                    hist_record(&hist, batch->stamp, strlen(line));
+                }
+            } else {
+                receive_message(&message, &mailbox);
+                if (mailbox.persistent) {
+                    if (message.mtype == MTYPE_OPEN) {
+                        // a sender that died mid-session never closed it
+                        if (hist.messages)
+                            session_report(&mailbox);
+                        printf("\nsession of %s\n", message.mtext);
+                        time_taken = 0; // not the idle wait for this sender
+                    } else if (message.mtype == MTYPE_CLOSE) {
+                        session_report(&mailbox);
+                    }
+                    if (message.mtype != MTYPE_LINE)
+                        continue;
+                }
+
+                // the empty end frame; the method 7 queue sends one per receiver
+                if (message.mlen == 0) {
+                    break;
+                }
+                deliver(&mailbox, message.mtext, message.mlen - 1, 0);
+                hist_record(&hist, message.stamp, message.mlen - 1);
+            }
+            if (lockstep) sem_post(sender_sem);
         }
-        printf("\033[32mReceived: %s\033[0m", message.mtext);
-        sem_post(sender_sem);
     }
+    free(batch);
+    deliver_flush(&mailbox);
 
-    printf("\nTotal time taken in receiving msg: %f seconds\n", time_taken);
+    if (!mailbox.ping) {
+        printf("\nTotal time taken in receiving msg: %f seconds\n", time_taken);
+        hist_report(&hist, "receive");
+    }
+    topology_report(mailbox.stats);
+    checksum_report(&mailbox);
+    if (mailbox_is_ring(&mailbox) || mailbox.flag == 7)
+        printf("receive blocked %llu times waiting for data\n", (unsigned long long)mailbox.blocked);
+    if (mailbox.flag == 7)
+        mpmc_leave(&mailbox, &hist, received, reordered);
 
-    if (mailbox.flag == 2) {
-        munmap(mailbox.storage.shm_addr, sizeof(message_t));
+    if (mailbox.stream && mailbox.storage.ring->stream_size) {
+        munmap((void*)mailbox.stream_addr, mailbox.storage.ring->stream_size);
+    }
+    if (mailbox_is_ring(&mailbox)) {
+        munmap(mailbox.storage.ring, mailbox.mapped);
+        if (mailbox.flag == 6) {
+            close(mailbox.data_fd);
+            close(mailbox.space_fd);
+        }
+    } else if (mailbox.flag == 2) {
+        munmap(mailbox.storage.shm_addr, mailbox.mapped);
+    } else if (mailbox.flag == 3) {
+        mq_close(mailbox.storage.mqd);
+        mq_unlink(MQ_NAME);
+    } else if (mailbox.flag == 4) {
+        close(mailbox.reader->fd);
+        free(mailbox.reader);
+        unlink(FIFO_NAME);
+    } else if (mailbox.flag == 5) {
+        close(mailbox.storage.fd);
+    }
+    if (mailbox.writer) {
+        close(mailbox.writer->fd);
+        free(mailbox.writer);
     }
 
     sem_close(sender_sem);
@@ -115,5 +771,5 @@ int main(int argc, char* argv[]) {
     sem_unlink("/sender_sem");
     sem_unlink("/receiver_sem");
 
-    return 0;
+    return mailbox.corrupt ? 1 : 0;
 }
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,57 +9,512 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <time.h>
 
-typedef struct {
-    long mtype;
-    char mtext[2000];
-} message_t;
-
-typedef struct {
-    int flag;      // 1 for message passing, 2 for shared memory
-    union {
-        int msqid;     // ID for message queue
-        char* shm_addr; // Share memory address
-    } storage;
-} mailbox_t;
+#include "mailbox.h"
+
 struct timespec start, end;
 double time_taken;
-void send_message(message_t message, mailbox_t* mailbox_ptr) {
+histogram_t hist;  // per message send latency, semaphore waits included
+void send_message(message_t* message_ptr, mailbox_t* mailbox_ptr) {
+    uint64_t ready = 0; // when the ring or queue had room, the copy starts there
+
+    if (mailbox_ptr->checksum)
+        message_ptr->crc = crc32c(0, message_ptr->mtext, message_ptr->mlen);
+
     if ( mailbox_ptr->flag == 1 ) {
+        size_t size = MSG_HDR + (mailbox_ptr->fixed ? sizeof(message_ptr->mtext) : message_ptr->mlen);
         clock_gettime(CLOCK_MONOTONIC, &start);
-	    if ( msgsnd(mailbox_ptr->storage.msqid, &message, sizeof(message.mtext), 0) == -1 ) {
+	    if ( msgsnd(mailbox_ptr->storage.msqid, message_ptr, size, 0) == -1 ) {
             perror("msgsnd failed");
             exit(1);
         }
         clock_gettime(CLOCK_MONOTONIC, &end);
         time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    } else if (mailbox_is_ring(mailbox_ptr)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        message_t* slot = ring_reserve(mailbox_ptr);
+        ready = now_ns();
+        slot->mtype = message_ptr->mtype;
+        slot->stamp = message_ptr->stamp;
+        slot->mlen = message_ptr->mlen;
+        slot->crc = message_ptr->crc;
+        if (mailbox_ptr->fixed) {
+            strcpy(slot->mtext, message_ptr->mtext);
+        } else {
+            memcpy(slot->mtext, message_ptr->mtext, message_ptr->mlen);
+        }
+        ring_publish(mailbox_ptr);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    } else if (mailbox_ptr->flag == 7) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        mpmc_slot_t* slot = mpmc_reserve(mailbox_ptr);
+        ready = now_ns();
+        slot->producer = mailbox_ptr->id;
+        slot->sequence = mailbox_ptr->sequence++;
+        slot->message.mtype = message_ptr->mtype;
+        slot->message.stamp = message_ptr->stamp;
+        slot->message.mlen = message_ptr->mlen;
+        slot->message.crc = message_ptr->crc;
+        if (mailbox_ptr->fixed) {
+            strcpy(slot->message.mtext, message_ptr->mtext);
+        } else {
+            memcpy(slot->message.mtext, message_ptr->mtext, message_ptr->mlen);
+        }
+        mpmc_publish(mailbox_ptr, slot);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
     } else if (mailbox_ptr->flag == 2) {
 
 	    clock_gettime(CLOCK_MONOTONIC, &start);
-        strcpy(mailbox_ptr->storage.shm_addr, message.mtext); 
+        message_t* slot = (message_t*)mailbox_ptr->storage.shm_addr;
+        slot->mtype = message_ptr->mtype;
+        slot->stamp = message_ptr->stamp;
+        slot->mlen = message_ptr->mlen;
+        slot->crc = message_ptr->crc;
+        if (mailbox_ptr->fixed) {
+            strcpy(slot->mtext, message_ptr->mtext);
+        } else {
+            memcpy(slot->mtext, message_ptr->mtext, message_ptr->mlen);
+        }
         clock_gettime(CLOCK_MONOTONIC, &end);
         time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
 
+    } else if (mailbox_ptr->flag == 3) {
+        size_t size = MSG_HDR + message_ptr->mlen;
+        // a fixed frame fills the queue's messages, which may be smaller than a message_t
+        if (mailbox_ptr->fixed)
+            size = (size_t)mailbox_ptr->mq_msgsize < MSG_HDR + sizeof(message_ptr->mtext) ? (size_t)mailbox_ptr->mq_msgsize
+                                                                                          : MSG_HDR + sizeof(message_ptr->mtext);
+        // the end marker goes at the lowest priority so it stays behind every line
+        unsigned int priority = message_ptr->mtype == MTYPE_LINE ? mailbox_ptr->priority : 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (mq_send(mailbox_ptr->storage.mqd, MSG_BODY(message_ptr), size, priority) == -1) {
+            perror("mq_send failed");
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    } else if (mailbox_ptr->flag == 4 || mailbox_ptr->flag == 5) {
+        size_t size = MSG_HDR + (mailbox_ptr->fixed ? sizeof(message_ptr->mtext) : message_ptr->mlen);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        // a seqpacket send keeps the message boundary, the FIFO reader finds it from mlen
+        if (write_full(mailbox_ptr->storage.fd, MSG_BODY(message_ptr), size) == -1) {
+            perror("write failed");
+            exit(1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
     } else {
         printf("Unknown communication method\n");
         exit(1);
     }
+    uint64_t begin = timespec_ns(&start);
+    stats_record(mailbox_ptr, message_ptr->mlen, ready ? ready - begin : 0, timespec_ns(&end) - (ready ? ready : begin));
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <communication method> <input file>\n", argv[0]);
+// sem_wait of the lockstep handoff, counted as time waiting for the receiver
+static void lockstep_wait(sem_t* sem, mailbox_t* mailbox_ptr) {
+    uint64_t begin = now_ns();
+    sem_wait(sem);
+    stats_wait(mailbox_ptr, now_ns() - begin);
+}
+
+void send_batch(batch_t* batch, size_t length, mailbox_t* mailbox_ptr) {
+    batch->mlen = length;
+    if (mailbox_ptr->checksum)
+        batch->crc = crc32c(0, batch->mtext, length);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (msgsnd(mailbox_ptr->storage.msqid, batch, MSG_HDR + length, 0) == -1) {
+        perror("msgsnd failed");
         exit(1);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    stats_record(mailbox_ptr, length, 0, timespec_ns(&end) - timespec_ns(&start));
+}
+
+void send_line(const line_t* line, mailbox_t* mailbox_ptr) {
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    line_t* slot = ring_reserve(mailbox_ptr);
+    uint64_t ready = now_ns();
+    *slot = *line;
+    ring_publish(mailbox_ptr);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    stats_record(mailbox_ptr, line->length, ready - timespec_ns(&start), timespec_ns(&end) - ready);
+}
+
+/**
+ * Publish every line of the mapped input file as an (offset, length)
+ * descriptor, followed by an empty descriptor marking the end of the stream.
+ * A line longer than a descriptor's 32-bit length goes out in pieces the
+ * receiver writes back to back.
+ */
+void send_stream(mailbox_t* mailbox_ptr) {
+    const char* data = mailbox_ptr->stream_addr;
+    uint64_t size = mailbox_ptr->storage.ring->stream_size;
+    line_t line = { 0 };
 
-    int method = atoi(argv[1]);
-    const char* input_file = argv[2];
+    while (line.offset < size) {
+        const char* newline = memchr(data + line.offset, '\n', size - line.offset);
+        uint64_t length = newline ? newline - (data + line.offset) + 1 : size - line.offset;
+        // INT_MAX rather than UINT32_MAX so the echo's %.*s precision holds it too
+        line.length = length < INT_MAX ? length : INT_MAX;
+        line.stamp = now_ns();
+        if (mailbox_ptr->checksum)
+            line.crc = crc32c(0, data + line.offset, line.length);
+        if (!mailbox_ptr->quiet)
+            printf("\033[31mSent: %.*s\033[0m", (int)line.length, data + line.offset);
+        send_line(&line, mailbox_ptr);
+        hist_record(&hist, line.stamp, line.length);
+        line.offset += line.length;
+    }
+    line.length = 0;
+    line.stamp = now_ns();
+    send_line(&line, mailbox_ptr);
+}
 
-    mailbox_t mailbox;
+/**
+ * Read the input file straight into ring slots, one chunk each, so the next
+ * read overlaps the receiver draining the previous chunk. A short chunk,
+ * possibly empty, ends the transfer.
+ */
+void send_file(const char* path, mailbox_t* mailbox_ptr) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open failed");
+        exit(1);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    uint32_t flags = 0;
+    while (!(flags & CHUNK_END)) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        chunk_t* chunk = ring_reserve(mailbox_ptr);
+        uint64_t ready = now_ns();
+        ssize_t length = read_full(fd, chunk->data, mailbox_ptr->chunk);
+        if (length == -1) {
+            perror("read failed");
+            exit(1);
+        }
+        flags = (size_t)length < mailbox_ptr->chunk ? CHUNK_END : 0;
+        chunk->length = length;
+        chunk->flags = flags;
+        if (mailbox_ptr->checksum)
+            chunk->crc = crc32c(0, chunk->data, length);
+        chunk->stamp = now_ns();
+        ring_publish(mailbox_ptr);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        time_taken += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+        stats_record(mailbox_ptr, length, ready - timespec_ns(&start), timespec_ns(&end) - ready);
+        hist_record(&hist, timespec_ns(&start), length);
+    }
+    close(fd);
+}
+
+/**
+ * Mark the start or the end of this run's session on a persistent ring.
+ */
+void send_session(long mtype, const char* text, mailbox_t* mailbox_ptr) {
+    message_t message;
+
+    message.mtype = mtype;
+    message.stamp = now_ns();
+    snprintf(message.mtext, sizeof(message.mtext), "%s", text);
+    message.mlen = strlen(message.mtext) + 1;
+    send_message(&message, mailbox_ptr);
+}
+
+/**
+ * Time rounds round trips of every payload size through the receiver and
+ * back, after PING_WARMUP untimed ones, and print the median and the 99th
+ * percentile of each. Sizes the method cannot carry in one frame get a row
+ * saying so. An empty frame ends the receiver's echo.
+ */
+void ping_run(mailbox_t* mailbox_ptr, mailbox_t* back, const uint32_t* sizes, int count, long rounds) {
+    static histogram_t rtt;
+    ping_t* frame = malloc(sizeof(ping_t) + PING_MAX);
+    size_t limit = ping_limit(mailbox_ptr);
+
+    if (!frame) {
+        perror("malloc failed");
+        exit(1);
+    }
+    for (int i = 0; i < PING_MAX; ++i)
+        frame->mtext[i] = i;
+    printf("round trips through method %d and back, %ld per size\n", mailbox_ptr->flag, rounds);
+    printf("%8s %10s %10s %10s\n", "bytes", "p50 us", "p99 us", "max us");
+    for (int i = 0; i < count; ++i) {
+        if (sizes[i] > limit) {
+            printf("%8u  more than the %zu bytes one frame of this method holds\n", sizes[i], limit);
+            continue;
+        }
+        memset(&rtt, 0, sizeof(rtt));
+        for (long round = -PING_WARMUP; round < rounds; ++round) {
+            frame->mtype = MTYPE_PING;
+            frame->mlen = sizes[i];
+            frame->stamp = now_ns();
+            ping_put(mailbox_ptr, frame);
+            ping_get(back, frame, MTYPE_PONG);
+            if (frame->mlen != sizes[i]) {
+                fprintf(stderr, "a ping of %u bytes came back with %u\n", sizes[i], frame->mlen);
+                exit(1);
+            }
+            if (round >= 0)
+                hist_record(&rtt, frame->stamp, frame->mlen);
+        }
+        printf("%8u %10.2f %10.2f %10.2f\n", sizes[i], hist_percentile(&rtt, 50) / 1e3,
+               hist_percentile(&rtt, 99) / 1e3, rtt.max / 1e3);
+        fflush(stdout);
+    }
+    frame->mtype = MTYPE_PING;
+    frame->mlen = 0;
+    frame->stamp = now_ns();
+    ping_put(mailbox_ptr, frame);
+    free(frame);
+}
+
+static void usage(const char* prog) {
+    fprintf(stderr, "Usage: %s [-q] [-c] [-r slots] [-f] [-s spins] [-d] [-a cpu] [-H] [-m] [-b bytes] [-B bytes] [-F] [-M count] [-S bytes]\n"
+                    "          [-p prio] [-P senders] [-C receivers] [-R sizes [-n rounds]] <communication method> [<input file>]\n", prog);
+    fprintf(stderr, "  -q        do not echo the sent lines\n");
+    fprintf(stderr, "  -c        stamp a CRC32C on every payload for the receiver's -c to verify\n");
+    fprintf(stderr, "  -r slots  shared memory ring with a power-of-two number of slots (method 2, 6)\n");
+    fprintf(stderr, "  -f        spin, then sleep on a futex instead of yielding; without -r a single\n"
+                    "            slot replaces the semaphore handoff (method 2, 6)\n");
+    fprintf(stderr, "  -s spins  polls of the receiver's index before blocking (default %d)\n", RING_SPIN);
+    fprintf(stderr, "  -d        stream into the ring of a receiver started with -d, then detach (method 2)\n");
+    fprintf(stderr, "  -a cpu    pin the sender to this cpu\n");
+    fprintf(stderr, "  -H        back the ring or queue with huge pages from " HUGE_DIR " (method 2, 6, 7)\n");
+    fprintf(stderr, "  -m        map the input file and pass line descriptors through the ring\n");
+    fprintf(stderr, "  -b bytes  pack lines into batches of up to this many bytes per msgsnd (method 1,\n"
+                    "            bounded by kernel.msgmax)\n");
+    fprintf(stderr, "  -B bytes  send the file as binary chunks of this size instead of lines; the ring\n"
+                    "            defaults to two chunks, filled by the sender while the receiver drains\n"
+                    "            the other (method 2, 6)\n");
+    fprintf(stderr, "  -F        fixed-size framing: always send the whole mtext\n");
+    fprintf(stderr, "  -M count  POSIX queue depth, mq_maxmsg (method 3)\n");
+    fprintf(stderr, "  -S bytes  POSIX queue message size, mq_msgsize; longer lines are split (method 3)\n");
+    fprintf(stderr, "  -p prio   mq_send priority of the lines (method 3)\n");
+    fprintf(stderr, "  -P count  senders sharing the queue, each started with its own input file (method 7)\n");
+    fprintf(stderr, "  -C count  receivers sharing the queue (method 7)\n");
+    fprintf(stderr, "  -R sizes  instead of sending a file, time round trips of these comma separated\n"
+                    "            payload sizes, up to %d bytes, through a receiver started with -R\n"
+                    "            (method 1 to 6)\n", PING_MAX);
+    fprintf(stderr, "  -n count  round trips per size (default 10000)\n");
+    fprintf(stderr, "methods: 1 System V msgqueue, 2 shared memory, 3 POSIX mqueue, 4 FIFO,\n"
+                    "         5 unix seqpacket socket, 6 shared memory ring with eventfd,\n"
+                    "         7 shared memory queue of several senders and receivers\n");
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    mailbox_t mailbox = { .spin = RING_SPIN, .producers = 1, .consumers = 1, .cpu = -1 };
     message_t message;
+    int opt;
+    uint32_t ping_sizes[32];
+    int ping_count = 0;
+    long ping_rounds = 10000;
+
+    while ((opt = getopt(argc, argv, "qcr:fs:da:Hmb:B:FM:S:p:P:C:R:n:")) != -1) {
+        switch (opt) {
+        case 'q':
+            mailbox.quiet = 1;
+            break;
+        case 'c':
+            mailbox.checksum = 1;
+            break;
+        case 'r':
+            mailbox.slots = strtoul(optarg, NULL, 0);
+            if (mailbox.slots == 0 || (mailbox.slots & (mailbox.slots - 1))) {
+                fprintf(stderr, "ring slots must be a power of two\n");
+                exit(1);
+            }
+            break;
+        case 'f':
+            mailbox.wait = RING_WAIT_FUTEX;
+            break;
+        case 's':
+            mailbox.spin = strtol(optarg, NULL, 0);
+            break;
+        case 'd':
+            mailbox.persistent = 1;
+            break;
+        case 'a':
+            mailbox.cpu = strtol(optarg, NULL, 0);
+            break;
+        case 'H':
+            mailbox.huge = 1;
+            break;
+        case 'm':
+            mailbox.stream = 1;
+            break;
+        case 'b':
+            mailbox.batch = strtoul(optarg, NULL, 0);
+            if (mailbox.batch < MSG_HDR + sizeof(message.mtext)) {
+                fprintf(stderr, "batch must hold at least one line (%zu bytes)\n", MSG_HDR + sizeof(message.mtext));
+                exit(1);
+            }
+            // msgsnd refuses anything longer, and the receiver would wait forever
+            if (mailbox.batch > (size_t)kernel_msgmax()) {
+                fprintf(stderr, "batch must fit in kernel.msgmax (%ld bytes)\n", kernel_msgmax());
+                exit(1);
+            }
+            break;
+        case 'B':
+            mailbox.chunk = strtoul(optarg, NULL, 0);
+            if (mailbox.chunk == 0 || mailbox.chunk > CHUNK_MAX) {
+                fprintf(stderr, "chunks must be between 1 and %d bytes\n", CHUNK_MAX);
+                exit(1);
+            }
+            break;
+        case 'F':
+            mailbox.fixed = 1;
+            break;
+        case 'M':
+            mailbox.mq_maxmsg = strtol(optarg, NULL, 0);
+            break;
+        case 'S':
+            mailbox.mq_msgsize = strtol(optarg, NULL, 0);
+            // a line fragment needs a character and its NUL
+            if (mailbox.mq_msgsize < (long)MSG_HDR + 2 || mailbox.mq_msgsize > (long)(MSG_HDR + PING_MAX)) {
+                fprintf(stderr, "message size must be between %zu and %zu bytes\n", MSG_HDR + 2, MSG_HDR + PING_MAX);
+                exit(1);
+            }
+            break;
+        case 'p':
+            mailbox.priority = strtoul(optarg, NULL, 0);
+            break;
+        case 'P':
+            mailbox.producers = strtoul(optarg, NULL, 0);
+            break;
+        case 'C':
+            mailbox.consumers = strtoul(optarg, NULL, 0);
+            break;
+        case 'R':
+            mailbox.ping = 1;
+            for (char* size = strtok(optarg, ","); size; size = strtok(NULL, ",")) {
+                if (ping_count == 32) {
+                    fprintf(stderr, "at most 32 sizes\n");
+                    exit(1);
+                }
+                ping_sizes[ping_count] = strtoul(size, NULL, 0);
+                if (ping_sizes[ping_count] == 0 || ping_sizes[ping_count] > PING_MAX) {
+                    fprintf(stderr, "sizes must be between 1 and %d bytes\n", PING_MAX);
+                    exit(1);
+                }
+                ping_count++;
+            }
+            break;
+        case 'n':
+            ping_rounds = strtol(optarg, NULL, 0);
+            if (ping_rounds <= 0) {
+                fprintf(stderr, "rounds must be positive\n");
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != (mailbox.ping ? 1 : 2))
+        usage(argv[0]);
+
+    int method = atoi(argv[optind]);
+    const char* input_file = argv[optind + 1];
+
     mailbox.flag = method;
+    if (mailbox.batch && mailbox.flag != 1) {
+        fprintf(stderr, "batching needs method 1\n");
+        exit(1);
+    }
+    if (mailbox.wait == RING_WAIT_FUTEX && mailbox.flag != 2 && mailbox.flag != 6) {
+        fprintf(stderr, "futex waiting needs method 2 or 6\n");
+        exit(1);
+    }
+    if (mailbox.ping) {
+        if (!ping_count || mailbox.flag < 1 || mailbox.flag > 6 || mailbox.stream || mailbox.batch || mailbox.chunk ||
+            mailbox.persistent) {
+            fprintf(stderr, "round trips need sizes and method 1 to 6 without -m, -b, -B or -d\n");
+            exit(1);
+        }
+        // one frame is in flight at a time
+        if (mailbox.flag == 6 && !mailbox.slots)
+            mailbox.slots = 2;
+        // a queue of this sender's making holds the largest size it was asked for
+        if (mailbox.flag == 3 && !mailbox.mq_msgsize) {
+            uint32_t largest = 0;
+            for (int i = 0; i < ping_count; ++i)
+                if (ping_sizes[i] > largest)
+                    largest = ping_sizes[i];
+            long msgsize_max = mqueue_msgsize_max();
+            mailbox.mq_msgsize = (long)MSG_HDR + largest < msgsize_max ? (long)MSG_HDR + largest : msgsize_max;
+        }
+    } else if (mailbox.mq_msgsize > (long)(MSG_HDR + sizeof(message.mtext))) {
+        fprintf(stderr, "message size above %zu bytes needs -R\n", MSG_HDR + sizeof(message.mtext));
+        exit(1);
+    }
+    if (mailbox.chunk) {
+        if ((mailbox.flag != 2 && mailbox.flag != 6) || mailbox.stream || mailbox.persistent) {
+            fprintf(stderr, "binary transfer needs method 2 or 6 without -m or -d\n");
+            exit(1);
+        }
+        // double buffering: the sender fills one chunk while the receiver drains the other
+        if (!mailbox.slots)
+            mailbox.slots = 2;
+    }
+    if (mailbox.persistent) {
+        if (mailbox.flag != 2 || mailbox.stream) {
+            fprintf(stderr, "a persistent receiver serves method 2 without streaming\n");
+            exit(1);
+        }
+        // the receiver's ring header decides the geometry and the waiting
+        mailbox.slots = RING_SLOTS;
+    }
+    if (mailbox.flag == 6) {
+        if (mailbox.wait != RING_WAIT_FUTEX)
+            mailbox.wait = RING_WAIT_EVENTFD;
+        if (!mailbox.slots)
+            mailbox.slots = RING_SLOTS;
+    }
+    if (mailbox.flag == 7) {
+        if (!mailbox.slots)
+            mailbox.slots = RING_SLOTS;
+        if (mailbox.producers == 0 || mailbox.producers > MPMC_MAX || mailbox.consumers == 0) {
+            fprintf(stderr, "the queue needs 1 to %d senders and at least one receiver\n", MPMC_MAX);
+            exit(1);
+        }
+    }
+    // a one slot ring is the semaphore handoff with a futex on head and tail
+    if (mailbox.wait == RING_WAIT_FUTEX && !mailbox.slots)
+        mailbox.slots = 1;
+    if (mailbox.stream && !mailbox_is_ring(&mailbox)) {
+        fprintf(stderr, "streaming needs method 2 with a ring (-r) or method 6\n");
+        exit(1);
+    }
+    if (mailbox.huge && !mailbox_is_ring(&mailbox) && mailbox.flag != 7) {
+        fprintf(stderr, "huge pages need a ring or the method 7 queue\n");
+        exit(1);
+    }
+    if (mailbox.ping && mailbox_is_ring(&mailbox)) {
+        // ring slots of the largest payload, the layout of a binary transfer
+        for (int i = 0; i < ping_count; ++i)
+            if (ping_sizes[i] > mailbox.chunk)
+                mailbox.chunk = ping_sizes[i];
+    }
+    if (mailbox.cpu >= 0)
+        pin_cpu(mailbox.cpu);
+    // the ring replaces the per message semaphore handshake, the other transports block on their own
+    int lockstep = mailbox_is_lockstep(&mailbox);
+    // longest line that fits one message
+    size_t line_max = sizeof(message.mtext);
+
+    const char* crc_impl = mailbox.checksum ? crc32c_init() : NULL;
+    stats_open(&mailbox, 1);
 
     sem_t *sender_sem = sem_open("/sender_sem", O_CREAT, 0644, 1);
     sem_t *receiver_sem = sem_open("/receiver_sem", O_CREAT, 0644, 0);
@@ -78,47 +535,265 @@ int main(int argc, char* argv[]) {
             perror("msgget failed");
             exit(1);
         }
+    } else if (mailbox.persistent) {
+        // the receiver created the ring and keeps it, this run only borrows it
+        int shm_fd = segment_open(SHM_NAME, O_RDWR, mailbox.huge);
+        struct stat st;
+        if (shm_fd == -1 || fstat(shm_fd, &st) == -1) {
+            perror("shm_open failed");
+            exit(1);
+        }
+        if ((size_t)st.st_size < sizeof(ring_t)) {
+            fprintf(stderr, "%s is not a ring\n", SHM_NAME);
+            exit(1);
+        }
+        mailbox.storage.ring = segment_map(shm_fd, st.st_size, mailbox.huge);
+        mailbox.mapped = st.st_size;
+        close(shm_fd);
+        ring_t* ring = mailbox.storage.ring;
+        if (!ring->persistent || ring->slot_size != sizeof(message_t)) {
+            fprintf(stderr, "%s does not belong to a receiver started with -d\n", SHM_NAME);
+            exit(1);
+        }
+        mailbox.slots = ring->slots;
+        mailbox.wait = ring->wait;
+        ring_attach(ring);
+    } else if (mailbox_is_ring(&mailbox)) {
+        // method 6 hands an anonymous memfd to the receiver instead of naming the segment
+        int shm_fd = mailbox.flag == 6 ? memfd_create("mailbox_ring", mailbox.huge ? MFD_HUGETLB : 0)
+                                       : segment_open(SHM_NAME, O_CREAT | O_RDWR, mailbox.huge);
+        if (shm_fd == -1) {
+            perror("shm_open failed");
+            exit(1);
+        }
+        uint32_t slot_size = mailbox_slot_size(&mailbox);
+        // a round trip comes back through a second ring behind the first
+        mailbox.mapped = map_size(ring_size(mailbox.slots, slot_size) * (mailbox.ping ? 2 : 1), mailbox.huge);
+        if (ftruncate(shm_fd, mailbox.mapped) == -1) {
+            perror("ftruncate failed");
+            exit(1);
+        }
+        mailbox.storage.ring = segment_map(shm_fd, mailbox.mapped, mailbox.huge);
+        ring_init(mailbox.storage.ring, mailbox.slots, slot_size, mailbox.wait);
+        if (mailbox.ping)
+            ring_init((ring_t*)((char*)mailbox.storage.ring + ring_size(mailbox.slots, slot_size)), mailbox.slots,
+                      slot_size, mailbox.wait);
+
+        if (mailbox.stream) {
+            // the receiver maps the same file, so lines never leave the page cache
+            ring_t* ring = mailbox.storage.ring;
+            int fd = open(input_file, O_RDONLY);
+            struct stat st;
+            if (fd == -1 || fstat(fd, &st) == -1 || !realpath(input_file, ring->stream_path)) {
+                perror(input_file);
+                exit(1);
+            }
+            ring->stream_size = st.st_size;
+            if (st.st_size) {
+                mailbox.stream_addr = mmap(0, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+                if (mailbox.stream_addr == MAP_FAILED) {
+                    perror("mmap failed");
+                    exit(1);
+                }
+                madvise((void*)mailbox.stream_addr, st.st_size, MADV_SEQUENTIAL);
+            }
+            close(fd);
+        }
+
+        if (mailbox.flag == 6) {
+            mailbox.data_fd = eventfd(0, 0);
+            mailbox.space_fd = eventfd(0, 0);
+            if (mailbox.data_fd == -1 || mailbox.space_fd == -1) {
+                perror("eventfd failed");
+                exit(1);
+            }
+            int sock = mailbox_connect(SOCK_NAME);
+            int fds[3] = { shm_fd, mailbox.data_fd, mailbox.space_fd };
+            send_fds(sock, fds, 3);
+            close(sock);
+        } else {
+            sem_post(receiver_sem); // ring is ready, receiver may attach
+        }
+        close(shm_fd);
+    } else if (mailbox.flag == 3) {
+        struct mq_attr attr = {
+            .mq_maxmsg = mailbox.mq_maxmsg ? mailbox.mq_maxmsg : 10,
+            .mq_msgsize = mailbox.mq_msgsize ? mailbox.mq_msgsize : MSG_HDR + sizeof(message.mtext),
+        };
+        mailbox.storage.mqd = mq_open(MQ_NAME, O_CREAT | O_WRONLY, 0666, &attr);
+        if (mailbox.storage.mqd == (mqd_t)-1) {
+            perror("mq_open failed");
+            if (errno == EINVAL)
+                fprintf(stderr, "queue limits are capped by fs.mqueue.msg_max and fs.mqueue.msgsize_max\n");
+            exit(1);
+        }
+        // the receiver may have created the queue first
+        if (mq_getattr(mailbox.storage.mqd, &attr) == -1) {
+            perror("mq_getattr failed");
+            exit(1);
+        }
+        if (attr.mq_msgsize < (long)MSG_HDR + 2) {
+            fprintf(stderr, "%s holds messages of only %ld bytes\n", MQ_NAME, attr.mq_msgsize);
+            exit(1);
+        }
+        if (attr.mq_msgsize < (long)(MSG_HDR + line_max))
+            line_max = attr.mq_msgsize - MSG_HDR;
+        mailbox.mq_msgsize = attr.mq_msgsize;
+    } else if (mailbox.flag == 4) {
+        if (mkfifo(FIFO_NAME, 0666) == -1 && errno != EEXIST) {
+            perror("mkfifo failed");
+            exit(1);
+        }
+        mailbox.storage.fd = open(FIFO_NAME, O_WRONLY); // waits for the receiver to open its end
+        if (mailbox.storage.fd == -1) {
+            perror("open failed");
+            exit(1);
+        }
+    } else if (mailbox.flag == 5) {
+        mailbox.storage.fd = mailbox_connect(SOCK_NAME);
+    } else if (mailbox.flag == 7) {
+        mpmc_open(&mailbox, 1);
     } else if (mailbox.flag == 2) {
-        int shm_fd = shm_open("/shm_comm", O_CREAT | O_RDWR, 0666); //rwx
+        int shm_fd = shm_open(SHM_NAME, O_CREAT | O_RDWR, 0666); //rwx
         if (shm_fd == -1) {
             perror("shm_open failed");
             exit(1);
         }
-        ftruncate(shm_fd, sizeof(message_t));  // share memory size
-        mailbox.storage.shm_addr = mmap(0, sizeof(message_t), PROT_WRITE, MAP_SHARED, shm_fd, 0);
+        // the slot carries the pong back as well in ping-pong mode
+        mailbox.mapped = mailbox.ping ? sizeof(ping_t) + PING_MAX : sizeof(message_t);
+        ftruncate(shm_fd, mailbox.mapped);  // share memory size
+        mailbox.storage.shm_addr = mmap(0, mailbox.mapped, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, shm_fd, 0);
         if (mailbox.storage.shm_addr == MAP_FAILED) {
             perror("mmap failed");
             exit(1);
         }
     }
 
-    FILE* file = fopen(input_file, "r");
-    if (!file) {
-        perror("fopen failed");
-        exit(1);
-    }
+    if (mailbox.ping) {
+        mailbox_t back;
+        ping_open(&mailbox, &back, 1);
+        mailbox.full_sem = receiver_sem;
+        back.full_sem = sender_sem;
+        // the lockstep handoff starts with a token for the sender, the pong must not find it
+        while (sem_trywait(sender_sem) == 0)
+            ;
+        ping_run(&mailbox, &back, ping_sizes, ping_count, ping_rounds);
+        ping_close(&back, 1);
+    } else if (mailbox.stream) {
+        send_stream(&mailbox);
+    } else if (mailbox.chunk) {
+        send_file(input_file, &mailbox);
+    } else {
+        FILE* file = fopen(input_file, "r");
+        if (!file) {
+            perror("fopen failed");
+            exit(1);
+        }
+        if (mailbox.persistent)
+            send_session(MTYPE_OPEN, input_file, &mailbox);
 
-    while (fgets(message.mtext, sizeof(message.mtext), file) != NULL) {
-        sem_wait(sender_sem);
+        if (mailbox.batch) {
+            batch_t* batch = malloc(sizeof(batch_t) + mailbox.batch);
+            size_t used = 0;
+            if (!batch) {
+                perror("malloc failed");
+                exit(1);
+            }
+            batch->mtype = MTYPE_BATCH;
 
-        message.mtype = 1;
-        printf("\033[31mSent: %s\033[0m", message.mtext);
-        send_message(message, &mailbox);
-        sem_post(receiver_sem);
-    }
+            // flush when the next line does not fit, and once more at end of file
+            while (fgets(message.mtext, sizeof(message.mtext), file) != NULL) {
+                size_t length = strlen(message.mtext) + 1;
+                if (MSG_HDR + used + length > mailbox.batch) {
+                    batch->stamp = now_ns();
+                    lockstep_wait(sender_sem, &mailbox);
+                    send_batch(batch, used, &mailbox);
+                    sem_post(receiver_sem);
+                    hist_record(&hist, batch->stamp, used);
+                    used = 0;
+                }
+                memcpy(batch->mtext + used, message.mtext, length);
+                used += length;
+                if (!mailbox.quiet)
+                    printf("\033[31mSent: %s\033[0m", message.mtext);
+            }
+            if (used) {
+                batch->stamp = now_ns();
+                lockstep_wait(sender_sem, &mailbox);
+                send_batch(batch, used, &mailbox);
+                sem_post(receiver_sem);
+                hist_record(&hist, batch->stamp, used);
+            }
+            free(batch);
+        }
 
-    sem_wait(sender_sem);
-    strcpy(message.mtext, "exit");
-    send_message(message, &mailbox);
-    sem_post(receiver_sem); 
+        while (fgets(message.mtext, line_max, file) != NULL) {
+            message.stamp = now_ns();
+            if (lockstep) lockstep_wait(sender_sem, &mailbox);
 
-    fclose(file);
+            message.mtype = MTYPE_LINE;
+            message.mlen = strlen(message.mtext) + 1;
+            if (!mailbox.quiet)
+                printf("\033[31mSent: %s\033[0m", message.mtext);
+            send_message(&message, &mailbox);
+            if (lockstep) sem_post(receiver_sem);
+            hist_record(&hist, message.stamp, message.mlen - 1);
+        }
+
+        if (mailbox.persistent) {
+            send_session(MTYPE_CLOSE, "", &mailbox);
+        } else if (mailbox.flag == 7) {
+            // the receivers stop once every sender has finished, not on the first exit
+            mpmc_finish(&mailbox);
+        } else {
+            message.stamp = now_ns();
+            if (lockstep) lockstep_wait(sender_sem, &mailbox);
+            // an empty frame ends the transfer; every line carries at least its NUL,
+            // so no line, or fragment of a split line, can be taken for it
+            message.mtype = MTYPE_END;
+            message.mtext[0] = '\0';
+            message.mlen = 0;
+            send_message(&message, &mailbox);
+            if (lockstep) sem_post(receiver_sem);
+        }
+
+        fclose(file);
+    }
 
-    printf("\nTotal time taken in sending msg: %f seconds\n", time_taken);
+    if (!mailbox.ping) {
+        printf("\nTotal time taken in sending msg: %f seconds\n", time_taken);
+        hist_report(&hist, "send");
+    }
+    topology_report(mailbox.stats);
+    if (crc_impl)
+        printf("checksums: CRC32C (%s) on every payload\n", crc_impl);
+    if (mailbox_is_ring(&mailbox) || mailbox.flag == 7)
+        printf("send blocked %llu times waiting for room\n", (unsigned long long)mailbox.blocked);
 
-    if (mailbox.flag == 2) {
-        munmap(mailbox.storage.shm_addr, sizeof(message_t));
-        shm_unlink("/shm_comm"); 
+    if (mailbox.stream && mailbox.storage.ring->stream_size) {
+        munmap((void*)mailbox.stream_addr, mailbox.storage.ring->stream_size);
+    }
+    if (mailbox.persistent) {
+        // leave the ring mapped by the receiver for the next sender
+        ring_detach(mailbox.storage.ring);
+        munmap(mailbox.storage.ring, mailbox.mapped);
+    } else if (mailbox.flag == 6) {
+        munmap(mailbox.storage.ring, mailbox.mapped);
+        close(mailbox.data_fd);
+        close(mailbox.space_fd);
+    } else if (mailbox.flag == 2 && mailbox.slots) {
+        ring_drain(mailbox.storage.ring);
+        munmap(mailbox.storage.ring, mailbox.mapped);
+        segment_unlink(SHM_NAME, mailbox.huge);
+    } else if (mailbox.flag == 2) {
+        munmap(mailbox.storage.shm_addr, mailbox.mapped);
+        shm_unlink(SHM_NAME);
+    } else if (mailbox.flag == 3) {
+        mq_close(mailbox.storage.mqd);
+    } else if (mailbox.flag == 4 || mailbox.flag == 5) {
+        close(mailbox.storage.fd);
+    } else if (mailbox.flag == 7) {
+        munmap(mailbox.storage.mpmc, mailbox.mapped);
     }
 
     sem_close(sender_sem);
@@ -12,6 +12,10 @@ int cd(char **args);
 int echo(char **args);
 int exit_shell(char **args);
 int record(char **args);
+int hash(char **args);
+int jobs(char **args);
+int wait_shell(char **args);
+int parallel(char **args);
 
 extern const char *builtin_str[];
 
@@ -4,7 +4,11 @@
 #define MAX_RECORD_NUM 16
 #define BUF_SIZE 1024
 
+#define ARENA_BLOCK 4096
+
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
 
 struct cmd_node {
 	char **args;
@@ -18,13 +22,23 @@ struct cmd_node {
 struct cmd {
 	struct cmd_node *head;
 	int pipe_num;
+	bool background;	// ended with &
+};
+
+// a command line's buffer and parse, released all at once after it runs
+struct arena {
+	struct arena_block *head;
 };
 
 extern char *history[MAX_RECORD_NUM];
 extern int history_count;
 
-char *read_line();
-struct cmd *split_line(char *);
+void *arena_alloc(struct arena *, size_t);
+void arena_reset(struct arena *);
+void arena_free(struct arena *);
+char *read_line(struct arena *);
+char *read_script_line(FILE *, struct arena *);
+struct cmd *split_line(char *, struct arena *);
 void test_cmd_struct(struct cmd *);
 void test_pipe_struct(struct cmd_node *pipe);
 #endif
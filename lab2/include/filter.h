@@ -0,0 +1,11 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#define FILTER_BLOCK (1 << 17)  // bytes read at a time
+
+int cat(char **args);
+int wc(char **args);
+int head(char **args);
+int grep(char **args);
+
+#endif
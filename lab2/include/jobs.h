@@ -0,0 +1,30 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include "command.h"
+
+// a pipeline started with &, kept until it is waited for or reported done
+struct job {
+    int id;           // %id
+    int n;            // stages
+    int live;         // stages not reaped yet
+    int status;       // exit status of the last stage once it is reaped
+    pid_t pid;        // the last stage, as reported when the job starts
+    pid_t *pids;      // -1 for a stage that is reaped or never started
+    char *command;
+    struct job *next;
+};
+
+void jobs_init();
+struct job *job_add(pid_t *pids, int n, struct cmd *cmd);
+struct job *job_find(const char *spec);
+void jobs_reap();
+int job_wait(struct job *job);
+int jobs_wait_all();
+void jobs_prune();
+void jobs_notify(FILE *out);
+void jobs_list(FILE *out);
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef PATH_CACHE_H
+#define PATH_CACHE_H
+
+#include <stdio.h>
+
+#define PATH_CACHE_BUCKETS 64
+
+const char *path_lookup(const char *name);
+void path_forget(const char *name);
+void path_clear();
+void path_list(FILE *out);
+
+#endif
@@ -1,11 +1,27 @@
 #ifndef SHELL_H
 #define SHELL_H
 
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/types.h>
 #include "command.h"
 
-int spawn_proc(struct cmd_node *);
+#define SPAWN_POSIX 0  // posix_spawn, falling back to fork when it fails
+#define SPAWN_FORK 1   // fork, redirection and execvp
+
+#define SCRIPT_BUF_SIZE (1 << 16)  // stdio buffer of a script being run
+
+extern int last_status;  // exit status of the last foreground command, like $?
+extern int spawn_engine; // SPAWN_POSIX or SPAWN_FORK
+extern int exit_requested; // set by the exit builtin
+extern bool interactive;   // reading commands from a user at the prompt
+
+pid_t spawn_proc(struct cmd_node *);
+int wait_pipeline(pid_t *pids, int n);
+int exit_status(int wstatus);
 int fork_cmd_node(struct cmd *cmd);
-void redirection(struct cmd_node *cmd);
+int redirection(struct cmd_node *cmd);
 void shell();
+void run_script(FILE *in, bool stop_on_error);
 
 #endif
@@ -1,20 +1,63 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "include/shell.h"
 #include "include/command.h"
+#include "include/jobs.h"
 
 int history_count;
 char *history[MAX_RECORD_NUM];
 
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-e] [-c command | script]\n", prog);
+	fprintf(stderr, "  -c command  run the command lines in command and exit\n");
+	fprintf(stderr, "  -e          stop at the first command line that fails\n");
+	fprintf(stderr, "  script      run the lines of script and exit\n");
+}
+
 int main(int argc, char *argv[])
 {
+	char *command = NULL;
+	bool stop_on_error = false;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:e")) != -1) {
+		switch (opt) {
+		case 'c':
+			command = optarg;
+			break;
+		case 'e':
+			stop_on_error = true;
+			break;
+		default:
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	jobs_init();
 	history_count = 0;
 	for (int i = 0; i < MAX_RECORD_NUM; ++i)
     	history[i] = (char *)malloc(BUF_SIZE * sizeof(char));
 
-	shell();
+	if (command != NULL || optind < argc) {
+		// batch mode: no prompt, no history
+		FILE *in = command != NULL ? fmemopen(command, strlen(command), "r")
+		                           : fopen(argv[optind], "re");
+		if (in == NULL) {
+			perror(command != NULL ? "fmemopen" : argv[optind]);
+			return 127;
+		}
+		run_script(in, stop_on_error);
+		fclose(in);
+	} else {
+		shell();
+	}
 
 	for (int i = 0; i < MAX_RECORD_NUM; ++i)
     	free(history[i]);
 
-	return 0;
+	return last_status;
 }
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "include/shell.h"
+#include "include/command.h"
+
+int history_count;
+char *history[MAX_RECORD_NUM];
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * @brief Start "true" count times through spawn_proc and wait for each
+ *
+ * @return double
+ * Return commands started per second
+ */
+static double spawn_rate(int engine, int count)
+{
+	char *args[] = { "true", NULL };
+	struct cmd_node node = { .args = args, .length = 1, .in = 0, .out = 1 };
+
+	spawn_engine = engine;
+	double start = now();
+	for (int i = 0; i < count; ++i) {
+		pid_t pid = spawn_proc(&node);
+		wait_pipeline(&pid, 1);
+	}
+	return count / (now() - start);
+}
+
+/**
+ * Grow the heap, touching every page so the page tables are there to copy,
+ * and measure how many commands per second each spawn engine starts.
+ *
+ * usage: ./spawn_bench [spawns per size] [largest heap in MB]
+ */
+int main(int argc, char *argv[])
+{
+	int count = argc > 1 ? atoi(argv[1]) : 500;
+	int max_mb = argc > 2 ? atoi(argv[2]) : 1024;
+	char *heap = NULL;
+
+	printf("%8s %12s %12s\n", "heap MB", "fork/s", "spawn/s");
+	for (int mb = 0; mb <= max_mb; mb = mb ? mb * 4 : 16) {
+		free(heap);
+		heap = NULL;
+		// the first round measures the shell with no extra heap
+		if (mb) {
+			heap = malloc((size_t)mb << 20);
+			if (!heap) {
+				perror("malloc");
+				return 1;
+			}
+			memset(heap, 1, (size_t)mb << 20);
+		}
+		double fork_rate = spawn_rate(SPAWN_FORK, count);
+		double posix_rate = spawn_rate(SPAWN_POSIX, count);
+		printf("%8d %12.0f %12.0f\n", mb, fork_rate, posix_rate);
+	}
+	free(heap);
+	return 0;
+}
@@ -1,12 +1,23 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include "../include/builtin.h"
+#include "../include/path_cache.h"
+#include "../include/shell.h"
+#include "../include/jobs.h"
+#include "../include/filter.h"
 
 
 
@@ -50,7 +61,7 @@ int help(char **args)
     	printf("%d: %s\n", i, builtin_str[i]);
   	}
     printf("--------------------------------------------------\n");
-	return 1;
+	return 0;
 }
 // ======================= requirement 2.1 =======================
 int cd(char **args)
@@ -75,6 +86,7 @@ int pwd(char **args)
         printf("%s\n", cwd);
     } else {
         perror("pwd");
+        return 1;
     }
     return 0;
 }
@@ -94,12 +106,13 @@ int echo(char **args)
 	if (newline)
 		printf("\n");
 
-	return 1;
+	return 0;
 }
 
 int exit_shell(char **args)
 {
-	return 0;
+	exit_requested = 1;
+	return args[1] ? atoi(args[1]) : last_status;
 }
 
 int record(char **args)
@@ -111,7 +124,315 @@ int record(char **args)
 		for (int i = history_count % MAX_RECORD_NUM; i < history_count % MAX_RECORD_NUM + MAX_RECORD_NUM; ++i)
 			printf("%2d: %s\n", i - history_count % MAX_RECORD_NUM + 1, history[i % MAX_RECORD_NUM]);
 	}
-	return 1;
+	return 0;
+}
+
+int hash(char **args)
+{
+	if (args[1] == NULL) {
+		path_list(stdout);
+	} else if (strcmp(args[1], "-r") == 0) {
+		path_clear();
+	} else {
+		for (int i = 1; args[i]; ++i)
+			if (path_lookup(args[i]) == NULL)
+				fprintf(stderr, "hash: %s: not found\n", args[i]);
+	}
+	return 0;
+}
+
+int jobs(char **args)
+{
+	jobs_list(stdout);
+	return 0;
+}
+
+int wait_shell(char **args)
+{
+	int status = 0;
+
+	// no operand waits for every job
+	if (args[1] == NULL)
+		return jobs_wait_all();
+	for (int i = 1; args[i]; ++i) {
+		struct job *job = job_find(args[i]);
+		if (job == NULL) {
+			fprintf(stderr, "wait: %s: no such job\n", args[i]);
+			status = 127;
+		} else {
+			status = job_wait(job);
+		}
+	}
+	return status;
+}
+
+// a running job of parallel: its child and, with -g, the memfd holding its output
+struct parallel_slot {
+	pid_t pid;
+	int out;
+};
+
+// arg with every {} replaced by input
+static char *fill_template(const char *arg, const char *input)
+{
+	size_t count = 0, input_len = strlen(input);
+	for (const char *p = arg; (p = strstr(p, "{}")) != NULL; p += 2)
+		++count;
+
+	char *filled = malloc(strlen(arg) + count * input_len + 1), *d = filled;
+	for (const char *p = arg, *q; ; p = q + 2) {
+		q = strstr(p, "{}");
+		if (q == NULL) {
+			strcpy(d, p);
+			break;
+		}
+		memcpy(d, p, q - p);
+		d += q - p;
+		memcpy(d, input, input_len);
+		d += input_len;
+	}
+	return filled;
+}
+
+/**
+ * @brief Read stdin whole in large blocks and split it into lines
+ *
+ * @param inputs Set to the lines, which point into the returned buffer
+ * @param count Set to the number of lines
+ * @return char*
+ * Return the buffer to free once the lines are used
+ */
+static char *read_inputs(char ***inputs, int *count)
+{
+	size_t size = 0, cap = 1 << 16;
+	char *buf = malloc(cap);
+	ssize_t r;
+
+	while ((r = read(STDIN_FILENO, buf + size, cap - size - 1)) != 0) {
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("parallel: read");
+			break;
+		}
+		size += r;
+		if (size == cap - 1)
+			buf = realloc(buf, cap *= 2);
+	}
+	buf[size] = '\0';
+
+	int max = 16;
+	*inputs = malloc(max * sizeof(char *));
+	*count = 0;
+	for (char *line = buf; line < buf + size; ) {
+		char *end = memchr(line, '\n', buf + size - line);
+		if (end == NULL)
+			end = buf + size;
+		*end = '\0';
+		if (*count == max)
+			*inputs = realloc(*inputs, (max *= 2) * sizeof(char *));
+		(*inputs)[(*count)++] = line;
+		line = end + 1;
+	}
+	return buf;
+}
+
+// start the template filled with input, its stdout on out
+static pid_t parallel_start(char **template, int len, const char *input, int out)
+{
+	char *argv[len + 2];
+	int argc = 0;
+	bool used = false;
+
+	for (int i = 0; i < len; ++i) {
+		if (strstr(template[i], "{}"))
+			used = true;
+		argv[argc++] = fill_template(template[i], input);
+	}
+	// like GNU parallel, a template without {} takes the input last
+	if (!used)
+		argv[argc++] = strdup(input);
+	argv[argc] = NULL;
+
+	struct cmd_node node = { .args = argv, .length = argc, .in = STDIN_FILENO, .out = out };
+	pid_t pid = spawn_proc(&node);
+	for (int i = 0; i < argc; ++i)
+		free(argv[i]);
+	return pid;
+}
+
+/**
+ * @brief Wait until any running job exits
+ * Only the jobs' own pids are waited for, so background jobs keep their
+ * children, and SIGCHLD is blocked between the checks and sigsuspend so an
+ * exit is never missed.
+ *
+ * @return int
+ * Return the slot of the job that exited
+ */
+static int parallel_wait(struct parallel_slot *slots, int running, int *wstatus)
+{
+	sigset_t chld, old;
+
+	sigemptyset(&chld);
+	sigaddset(&chld, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &chld, &old);
+	while (1) {
+		for (int i = 0; i < running; ++i) {
+			pid_t pid = waitpid(slots[i].pid, wstatus, WNOHANG);
+			if (pid == slots[i].pid || (pid == -1 && errno != EINTR)) {
+				if (pid == -1)
+					*wstatus = EXIT_FAILURE << 8;
+				sigprocmask(SIG_SETMASK, &old, NULL);
+				return i;
+			}
+		}
+		sigsuspend(&old);
+	}
+}
+
+// copy [offset, size) of fd to stdout through a buffer
+static void parallel_copy(int fd, off_t offset, off_t size)
+{
+	char buf[1 << 16];
+
+	while (offset < size) {
+		ssize_t n = pread(fd, buf, sizeof(buf), offset);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("parallel: pread");
+			return;
+		}
+		offset += n;
+		for (char *p = buf; n > 0; ) {
+			ssize_t w = write(STDOUT_FILENO, p, n);
+			if (w == -1 && errno == EINTR)
+				continue;
+			if (w == -1) {
+				perror("parallel: write");
+				return;
+			}
+			p += w;
+			n -= w;
+		}
+	}
+}
+
+// write the output a job kept in its memfd to stdout in one piece
+static void parallel_output(int fd)
+{
+	struct stat st;
+	off_t offset = 0;
+
+	if (fstat(fd, &st) == 0) {
+		while (offset < st.st_size) {
+			ssize_t n = sendfile(STDOUT_FILENO, fd, &offset, st.st_size - offset);
+			if (n == -1 && errno == EINTR)
+				continue;
+			// sendfile refuses an O_APPEND stdout, as in >> log
+			if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+				parallel_copy(fd, offset, st.st_size);
+				break;
+			}
+			if (n <= 0) {
+				perror("parallel: sendfile");
+				break;
+			}
+		}
+	}
+	close(fd);
+}
+
+/**
+ * @brief Run a command template once per input, at most -j at a time
+ * usage: parallel [-j N] [-g] command [{}]... [::: input...]
+ * Without ::: the inputs are the lines of stdin. -g holds each job's output
+ * back until it exits, so outputs of different jobs are not mixed.
+ *
+ * @return int
+ * Return the number of jobs that failed, at most 101 as in GNU parallel
+ */
+int parallel(char **args)
+{
+	long limit = sysconf(_SC_NPROCESSORS_ONLN);
+	bool group = false;
+	int i = 1;
+
+	for (; args[i] && args[i][0] == '-'; ++i) {
+		if (strcmp(args[i], "-g") == 0) {
+			group = true;
+		} else if (strncmp(args[i], "-j", 2) == 0) {
+			const char *n = args[i][2] ? args[i] + 2 : args[++i];
+			if (n == NULL || (limit = atol(n)) < 1) {
+				fprintf(stderr, "parallel: -j expects a number of jobs\n");
+				return 2;
+			}
+		} else {
+			fprintf(stderr, "parallel: unknown option %s\n", args[i]);
+			return 2;
+		}
+	}
+
+	char **template = args + i;
+	int len = 0;
+	while (template[len] && strcmp(template[len], ":::") != 0)
+		++len;
+	if (len == 0) {
+		fprintf(stderr, "usage: parallel [-j N] [-g] command [{}]... [::: input...]\n");
+		return 2;
+	}
+
+	char **inputs, *input_buf = NULL;
+	int count = 0;
+	if (template[len]) {
+		inputs = template + len + 1;
+		while (inputs[count])
+			++count;
+	} else {
+		input_buf = read_inputs(&inputs, &count);
+	}
+
+	if (limit > count)
+		limit = count ? count : 1;
+	struct parallel_slot *slots = malloc(limit * sizeof(struct parallel_slot));
+	int running = 0, failed = 0, next = 0;
+
+	fflush(stdout);
+	while (next < count || running > 0) {
+		if (next < count && running < limit) {
+			int out = group ? memfd_create("parallel", MFD_CLOEXEC) : STDOUT_FILENO;
+			if (out == -1) {
+				perror("parallel: memfd_create");
+				out = STDOUT_FILENO;
+			}
+			pid_t pid = parallel_start(template, len, inputs[next++], out);
+			if (pid == -1) {
+				if (out != STDOUT_FILENO)
+					close(out);
+				++failed;
+				continue;
+			}
+			slots[running].pid = pid;
+			slots[running++].out = out;
+			continue;
+		}
+
+		// a slot frees up as soon as any of its jobs exits
+		int wstatus, done = parallel_wait(slots, running, &wstatus);
+		if (exit_status(wstatus) != 0)
+			++failed;
+		if (slots[done].out != STDOUT_FILENO)
+			parallel_output(slots[done].out);
+		slots[done] = slots[--running];
+	}
+
+	free(slots);
+	if (input_buf) {
+		free(input_buf);
+		free(inputs);
+	}
+	return failed > 101 ? 101 : failed;
 }
 
 const char *builtin_str[] = {
@@ -121,6 +442,14 @@ const char *builtin_str[] = {
 	"echo",
  	"exit",
  	"record",
+	"hash",
+	"jobs",
+	"wait",
+	"parallel",
+	"cat",
+	"wc",
+	"head",
+	"grep",
 };
 
 const int (*builtin_func[]) (char **) = {
@@ -130,6 +459,14 @@ const int (*builtin_func[]) (char **) = {
 	&echo,
 	&exit_shell,
   	&record,
+	&hash,
+	&jobs,
+	&wait_shell,
+	&parallel,
+	&cat,
+	&wc,
+	&head,
+	&grep,
 };
 
 int num_builtins() {
@@ -5,81 +5,232 @@
 #include <stdlib.h>
 #include <string.h>
 
+// each block holds the allocations of one line until the arena is reset
+struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+    _Alignas(16) char data[];
+};
+
+static struct arena_block *arena_block_new(size_t size, struct arena_block *next) {
+    struct arena_block *block = malloc(sizeof(struct arena_block) + size);
+    if (block == NULL) {
+        perror("Unable to allocate arena");
+        exit(1);
+    }
+    block->next = next;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
 /**
- * @brief Read the user's input string
+ * @brief Take size bytes from the arena, valid until the next arena_reset
  *
- * @return char*
- * Return string
+ * @param arena Per-line arena
+ * @param size Bytes wanted
+ * @return void*
+ * Return memory aligned for any argument type
  */
-char *read_line() {
-    char *buffer = (char *)malloc(BUF_SIZE * sizeof(char));
-    if (buffer == NULL) {
-        perror("Unable to allocate buffer");
-        exit(1);
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_block *block = arena->head;
+    size = (size + 15) & ~(size_t)15;
+
+    if (block == NULL || block->size - block->used < size) {
+        size_t want = block ? block->size * 2 : ARENA_BLOCK;
+        while (want < size) want *= 2;
+        block = arena->head = arena_block_new(want, block);
     }
+    void *p = block->data + block->used;
+    block->used += size;
+    return p;
+}
 
-    if (fgets(buffer, BUF_SIZE, stdin) != NULL) {
-        if (buffer[0] == '\n' || buffer[0] == ' ' || buffer[0] == '\t') {
-            free(buffer);
-            buffer = NULL;
-        } else {
-            buffer[strcspn(buffer, "\n")] = 0;
-            strncpy(history[history_count % MAX_RECORD_NUM], buffer, BUF_SIZE);
-            ++history_count;
+/**
+ * @brief Release everything taken from the arena
+ * A line that needed more than one block leaves a single block big enough
+ * for all of it, so lines of that length stop reaching malloc.
+ *
+ * @param arena Per-line arena
+ */
+void arena_reset(struct arena *arena) {
+    struct arena_block *block = arena->head;
+
+    if (block == NULL)
+        return;
+    if (block->next != NULL) {
+        size_t total = 0;
+        while (block) {
+            struct arena_block *next = block->next;
+            total += block->size;
+            free(block);
+            block = next;
         }
+        block = arena->head = arena_block_new(total, NULL);
+    }
+    block->used = 0;
+}
+
+void arena_free(struct arena *arena) {
+    while (arena->head) {
+        struct arena_block *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+
+/**
+ * @brief Read one line from in, however long, into the arena
+ * getdelim gives the real length, so a NUL byte inside the line cannot make
+ * it look unfinished and pull the next line in; the line is cut at its first
+ * NUL instead.
+ *
+ * @return char*
+ * Return the line without its newline, NULL at the end of input
+ */
+static char *read_whole_line(FILE *in, struct arena *arena) {
+    static char *line;  // reused by every read, grown by getdelim
+    static size_t line_size;
+    ssize_t len = getdelim(&line, &line_size, '\n', in);
+
+    if (len == -1)
+        return NULL;
+    if (len > 0 && line[len - 1] == '\n')
+        --len;
+    char *nul = memchr(line, '\0', len);
+    if (nul)
+        len = nul - line;
+
+    char *buffer = arena_alloc(arena, len + 1);
+    memcpy(buffer, line, len);
+    buffer[len] = '\0';
+    return buffer;
+}
+
+/**
+ * @brief Read the user's input string, however long, into the arena
+ *
+ * @param arena Per-line arena
+ * @return char*
+ * Return string, empty for a blank line, NULL at the end of input
+ */
+char *read_line(struct arena *arena) {
+    char *buffer = read_whole_line(stdin, arena);
+
+    if (buffer == NULL)
+        return NULL;
+    if (buffer[0] == ' ' || buffer[0] == '\t') {
+        buffer[0] = '\0';
+    } else if (buffer[0] != '\0') {
+        snprintf(history[history_count % MAX_RECORD_NUM], BUF_SIZE, "%s", buffer);
+        ++history_count;
     }
 
     return buffer;
 }
 
+/**
+ * @brief Read a line of a script into the arena, leaving history alone
+ * Indentation is skipped and lines starting with # are comments, so a
+ * script can start with #!.
+ *
+ * @param in Script stream
+ * @param arena Per-line arena
+ * @return char*
+ * Return string, empty for a blank line, NULL at the end of the script
+ */
+char *read_script_line(FILE *in, struct arena *arena) {
+    char *buffer = read_whole_line(in, arena);
+
+    if (buffer == NULL)
+        return NULL;
+    buffer += strspn(buffer, " \t");
+    if (buffer[0] == '#')
+        buffer[0] = '\0';
+    return buffer;
+}
+
+// args of the stage starting at tokens[i]: everything up to the next pipe
+// that is not a redirection
+static int stage_args(char **tokens, int i, int n) {
+    int count = 0;
+    for (; i < n && tokens[i][0] != '|'; ++i) {
+        if (tokens[i][0] == '<' || tokens[i][0] == '>')
+            ++i;
+        else
+            ++count;
+    }
+    return count;
+}
+
+static struct cmd_node *new_node(struct arena *arena, int args_length) {
+    struct cmd_node *node = arena_alloc(arena, sizeof(struct cmd_node));
+    node->args = arena_alloc(arena, (args_length + 1) * sizeof(char *));
+    node->length = 0;
+    node->in_file = NULL;
+    node->out_file = NULL;
+    node->in = 0;
+    node->out = 1;
+    node->next = NULL;
+    return node;
+}
+
 /**
  * @brief Parse the user's command
+ * Tokens are gathered first so every stage's args can be sized to fit,
+ * and all of it comes from the arena, freed together by arena_reset.
  *
  * @param line User input command
+ * @param arena Per-line arena the cmd structure is taken from
  * @return struct cmd*
- * Return the parsed cmd structure
+ * Return the parsed cmd structure, NULL if a stage has no command or a
+ * redirection no file
  */
-struct cmd *split_line(char *line) {
-    int args_length = 10;
-    struct cmd *new_cmd = (struct cmd *)malloc(sizeof(struct cmd));
-    new_cmd->head = (struct cmd_node *)malloc(sizeof(struct cmd_node));
-    new_cmd->head->args = (char **)malloc(args_length * sizeof(char *));
-    for (int i = 0; i < args_length; ++i) new_cmd->head->args[i] = NULL;
-    new_cmd->head->length = 0;
-    new_cmd->head->next = NULL;
-    new_cmd->pipe_num = 0;
+struct cmd *split_line(char *line, struct arena *arena) {
+    // tokens are separated by at least one blank
+    char **tokens = arena_alloc(arena, (strlen(line) / 2 + 1) * sizeof(char *));
+    int n = 0;
+    for (char *token = strtok(line, " \t"); token != NULL; token = strtok(NULL, " \t"))
+        tokens[n++] = token;
+
+    // a trailing &, alone or stuck to the last word, runs the line in the background
+    bool background = false;
+    if (n > 0 && tokens[n - 1][strlen(tokens[n - 1]) - 1] == '&') {
+        background = true;
+        tokens[n - 1][strlen(tokens[n - 1]) - 1] = '\0';
+        if (tokens[n - 1][0] == '\0')
+            --n;
+    }
+
+    struct cmd *new_cmd = arena_alloc(arena, sizeof(struct cmd));
+    new_cmd->head = new_node(arena, stage_args(tokens, 0, n));
+    new_cmd->pipe_num = n;
+    new_cmd->background = background;
 
     struct cmd_node *temp = new_cmd->head;
-    temp->in_file = NULL;
-    temp->out_file = NULL;
-    temp->in = 0;
-    temp->out = 1;
-    char *token = strtok(line, " ");
-    while (token != NULL) {
-        if (token[0] == '|') {
-            struct cmd_node *new_pipe = (struct cmd_node *)malloc(sizeof(struct cmd_node));
-            new_pipe->args = (char **)malloc(args_length * sizeof(char *));
-            for (int i = 0; i < args_length; ++i) new_pipe->args[i] = NULL;
-            new_pipe->length = 0;
-            new_pipe->next = NULL;
-            new_pipe->in_file = NULL;
-            new_pipe->out_file = NULL;
-            new_pipe->in = 0;
-            new_pipe->out = 1;
-            temp->next = new_pipe;
-            temp = new_pipe;
-        } else if (token[0] == '<') {
-            token = strtok(NULL, " ");
-            temp->in_file = token;
-        } else if (token[0] == '>') {
-            token = strtok(NULL, " ");
-            temp->out_file = token;
+    for (int i = 0; i < n; ++i) {
+        if (tokens[i][0] == '|') {
+            temp->next = new_node(arena, stage_args(tokens, i + 1, n));
+            temp = temp->next;
+        } else if (tokens[i][0] == '<' || tokens[i][0] == '>') {
+            if (i + 1 == n || strchr("|<>", tokens[i + 1][0])) {
+                fprintf(stderr, "syntax error: missing file after %c\n", tokens[i][0]);
+                return NULL;
+            }
+            if (tokens[i][0] == '<')
+                temp->in_file = tokens[++i];
+            else
+                temp->out_file = tokens[++i];
         } else {
-            temp->args[temp->length] = token;
-            temp->length++;
+            temp->args[temp->length++] = tokens[i];
+        }
+    }
+    for (temp = new_cmd->head; temp; temp = temp->next) {
+        if (temp->length == 0) {
+            fprintf(stderr, "syntax error: empty command\n");
+            return NULL;
         }
-        token = strtok(NULL, " ");
-        new_cmd->pipe_num++;
+        temp->args[temp->length] = NULL;
     }
 
     return new_cmd;
@@ -0,0 +1,426 @@
+#define _GNU_SOURCE
+#include "../include/filter.h"
+#include "../include/shell.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// cat, wc, head and grep run inside the shell, so short files cost no fork
+// and exec. Options they do not handle go to the real command instead.
+
+static char *block;  // shared read buffer, grown by grep for long lines
+static size_t block_size;
+
+static char *block_buf(size_t size) {
+    if (size > block_size) {
+        char *grown = realloc(block, size);
+        if (grown == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        block = grown;
+        block_size = size;
+    }
+    return block;
+}
+
+// run args as the external command, on the stdin and stdout the builtin was given
+static int run_external(char **args) {
+    int n = 0;
+    while (args[n])
+        ++n;
+
+    struct cmd_node node = { .args = args, .length = n, .in = STDIN_FILENO, .out = STDOUT_FILENO };
+    fflush(stdout);
+    pid_t pid = spawn_proc(&node);
+    return wait_pipeline(&pid, 1);
+}
+
+// open a file operand, "-" being stdin
+static int open_input(const char *cmd, const char *name) {
+    if (name == NULL || strcmp(name, "-") == 0)
+        return STDIN_FILENO;
+
+    int fd = open(name, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        fflush(stdout);
+        fprintf(stderr, "%s: %s: %s\n", cmd, name, strerror(errno));
+    }
+    return fd;
+}
+
+static void close_input(int fd) {
+    if (fd != STDIN_FILENO)
+        close(fd);
+}
+
+// stdout failed, as when the reader of a pipe quit; stop instead of reading on
+static bool output_failed(const char *cmd) {
+    if (!ferror(stdout))
+        return false;
+    if (errno != EPIPE)
+        fprintf(stderr, "%s: write error: %s\n", cmd, strerror(errno));
+    return true;
+}
+
+static ssize_t read_block(int fd, char *buf, size_t size) {
+    ssize_t r;
+    while ((r = read(fd, buf, size)) == -1 && errno == EINTR)
+        ;
+    return r;
+}
+
+int cat(char **args) {
+    int status = 0;
+
+    for (int i = 1; args[i]; ++i)
+        if (args[i][0] == '-' && args[i][1] != '\0')
+            return run_external(args);
+
+    char *buf = block_buf(FILTER_BLOCK);
+    for (int i = 1; i == 1 || args[i]; ++i) {
+        int fd = open_input("cat", args[i]);
+        ssize_t r;
+
+        if (fd == -1) {
+            status = 1;
+            continue;
+        }
+        while ((r = read_block(fd, buf, FILTER_BLOCK)) > 0) {
+            fwrite(buf, 1, r, stdout);
+            if (output_failed("cat")) {
+                close_input(fd);
+                return 1;
+            }
+        }
+        if (r == -1) {
+            perror("cat");
+            status = 1;
+        }
+        close_input(fd);
+        if (args[i] == NULL)
+            break;
+    }
+    return status;
+}
+
+static void print_counts(bool *show, size_t *counts, int width, const char *name) {
+    bool first = true;
+
+    for (int k = 0; k < 3; ++k) {
+        if (!show[k])
+            continue;
+        printf(first ? "%*zu" : " %*zu", width, counts[k]);
+        first = false;
+    }
+    printf(name ? " %s\n" : "\n", name);
+}
+
+// columns wide enough for the total size of the inputs, as GNU wc sizes them;
+// 7 when an input is not a regular file and its size is unknown
+static int count_width(char **names, int files) {
+    off_t total = 0;
+    struct stat st;
+    int width = 1;
+
+    for (int f = 0; f == 0 || f < files; ++f) {
+        const char *name = files ? names[f] : NULL;
+        int error = name == NULL || strcmp(name, "-") == 0 ? fstat(STDIN_FILENO, &st) : stat(name, &st);
+        if (error == 0 && !S_ISREG(st.st_mode))
+            return 7;
+        if (error == 0)
+            total += st.st_size;
+    }
+    for (; total >= 10; total /= 10)
+        ++width;
+    return width;
+}
+
+/**
+ * @brief wc [-lwc] [file...]
+ * Newlines are counted with memchr, which scans a word at a time; words need
+ * a pass over every byte and are only counted when asked for.
+ */
+int wc(char **args) {
+    bool show[3] = { false, false, false };  // lines, words, bytes
+    int status = 0, i = 1;
+
+    for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; ++i) {
+        for (char *c = args[i] + 1; *c; ++c) {
+            if (*c == 'l')
+                show[0] = true;
+            else if (*c == 'w')
+                show[1] = true;
+            else if (*c == 'c')
+                show[2] = true;
+            else
+                return run_external(args);
+        }
+    }
+    if (!show[0] && !show[1] && !show[2])
+        show[0] = show[1] = show[2] = true;
+
+    int files = 0;
+    while (args[i + files])
+        ++files;
+    int width = count_width(args + i, files);
+    // one count of one input is printed bare, as GNU wc does
+    if (show[0] + show[1] + show[2] == 1 && files <= 1)
+        width = 1;
+    size_t total[3] = { 0, 0, 0 };
+    char *buf = block_buf(FILTER_BLOCK);
+
+    for (int f = 0; f == 0 || f < files; ++f) {
+        const char *name = files ? args[i + f] : NULL;
+        size_t counts[3] = { 0, 0, 0 };
+        bool in_word = false;
+        int fd = open_input("wc", name);
+        ssize_t r;
+
+        if (fd == -1) {
+            status = 1;
+            continue;
+        }
+        while ((r = read_block(fd, buf, FILTER_BLOCK)) > 0) {
+            counts[2] += r;
+            for (char *p = buf, *end = buf + r; (p = memchr(p, '\n', end - p)) != NULL; ++p)
+                ++counts[0];
+            if (show[1]) {
+                for (ssize_t k = 0; k < r; ++k) {
+                    bool space = buf[k] == ' ' || (buf[k] >= '\t' && buf[k] <= '\r');
+                    if (!space && !in_word)
+                        ++counts[1];
+                    in_word = !space;
+                }
+            }
+        }
+        if (r == -1) {
+            perror("wc");
+            status = 1;
+        }
+        close_input(fd);
+        print_counts(show, counts, width, name);
+        for (int k = 0; k < 3; ++k)
+            total[k] += counts[k];
+    }
+    if (files > 1)
+        print_counts(show, total, width, "total");
+    return status;
+}
+
+/**
+ * @brief head [-n N | -N] [file...]
+ * Whole blocks are written up to the Nth newline, found with memchr.
+ */
+int head(char **args) {
+    long lines = 10;
+    int status = 0, i = 1;
+
+    for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; ++i) {
+        char *end;
+        const char *n = args[i] + 1;
+
+        if (args[i][1] == 'n')
+            n = args[i][2] ? args[i] + 2 : args[++i];
+        if (n == NULL)
+            return run_external(args);
+        lines = strtol(n, &end, 10);
+        if (*end != '\0' || lines < 0)
+            return run_external(args);
+    }
+
+    int files = 0;
+    while (args[i + files])
+        ++files;
+    char *buf = block_buf(FILTER_BLOCK);
+
+    for (int f = 0; f == 0 || f < files; ++f) {
+        const char *name = files ? args[i + f] : NULL;
+        long left = lines;
+        int fd = open_input("head", name);
+        ssize_t r = 0;
+
+        if (fd == -1) {
+            status = 1;
+            continue;
+        }
+        if (files > 1)
+            printf(f ? "\n==> %s <==\n" : "==> %s <==\n", name);
+        while (left > 0 && (r = read_block(fd, buf, FILTER_BLOCK)) > 0) {
+            char *p = buf, *end = buf + r;
+            while (left > 0 && (p = memchr(p, '\n', end - p)) != NULL) {
+                ++p;
+                --left;
+            }
+            fwrite(buf, 1, left > 0 ? r : p - buf, stdout);
+            if (output_failed("head")) {
+                close_input(fd);
+                return 1;
+            }
+        }
+        if (r == -1) {
+            perror("head");
+            status = 1;
+        }
+        close_input(fd);
+    }
+    return status;
+}
+
+#define GREP_INVERT 1  // -v
+#define GREP_COUNT 2   // -c
+
+// write the lines of [p, end), each after prefix if there is one
+static void grep_write(const char *p, const char *end, const char *prefix) {
+    if (prefix == NULL) {
+        fwrite(p, 1, end - p, stdout);
+        return;
+    }
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        printf("%s:", prefix);
+        fwrite(p, 1, nl + 1 - p, stdout);
+        p = nl + 1;
+    }
+}
+
+static size_t count_lines(const char *p, const char *end) {
+    size_t n = 0;
+    for (; (p = memchr(p, '\n', end - p)) != NULL; ++p)
+        ++n;
+    return n;
+}
+
+/**
+ * @brief Select the whole lines of [p, end) that contain pattern
+ * The block is searched with memmem, and only a match is widened to its
+ * line, so lines that do not match are never looked at one by one.
+ *
+ * @return size_t
+ * Return the number of lines selected
+ */
+static size_t grep_lines(char *p, char *end, const char *pattern, size_t len, int flags, const char *prefix) {
+    size_t selected = 0;
+
+    while (p < end) {
+        char *match = memmem(p, end - p, pattern, len);
+        char *line = end, *next = end;
+
+        if (match) {
+            line = memrchr(p, '\n', match - p);
+            line = line ? line + 1 : p;
+            next = (char *)memchr(match, '\n', end - match) + 1;
+        }
+        if (flags & GREP_INVERT) {
+            selected += count_lines(p, line);
+            if (!(flags & GREP_COUNT))
+                grep_write(p, line, prefix);
+        } else if (match) {
+            ++selected;
+            if (!(flags & GREP_COUNT))
+                grep_write(line, next, prefix);
+        }
+        p = next;
+    }
+    return selected;
+}
+
+// grep one input a block at a time, carrying its last partial line to the next block
+static size_t grep_fd(int fd, const char *pattern, int flags, const char *prefix, int *status) {
+    size_t len = strlen(pattern), kept = 0, selected = 0;
+    char *buf = block_buf(FILTER_BLOCK);
+
+    while (1) {
+        ssize_t r = read_block(fd, buf + kept, block_size - kept - 1);
+        if (r == -1) {
+            perror("grep");
+            *status = 2;
+            break;
+        }
+        size_t size = kept + r;
+        if (r == 0) {
+            // a last line without its newline still counts
+            if (size > 0 && buf[size - 1] != '\n')
+                buf[size++] = '\n';
+            selected += grep_lines(buf, buf + size, pattern, len, flags, prefix);
+            break;
+        }
+
+        char *last = memrchr(buf, '\n', size);
+        if (last == NULL) {
+            // a line longer than the buffer
+            kept = size;
+            if (kept == block_size - 1)
+                buf = block_buf(block_size * 2);
+            continue;
+        }
+        selected += grep_lines(buf, last + 1, pattern, len, flags, prefix);
+        if (output_failed("grep")) {
+            *status = 2;
+            break;
+        }
+        kept = buf + size - (last + 1);
+        memmove(buf, last + 1, kept);
+    }
+    return selected;
+}
+
+/**
+ * @brief grep [-Fvc] pattern [file...], for fixed strings
+ * A pattern with regular expression characters goes to the real grep
+ * unless -F says it is fixed.
+ *
+ * @return int
+ * Return 0 if a line was selected, 1 if none was, 2 on an error
+ */
+int grep(char **args) {
+    int flags = 0, status = 0, i = 1;
+    bool fixed = false;
+
+    for (; args[i] && args[i][0] == '-' && args[i][1] != '\0'; ++i) {
+        for (char *c = args[i] + 1; *c; ++c) {
+            if (*c == 'F')
+                fixed = true;
+            else if (*c == 'v')
+                flags |= GREP_INVERT;
+            else if (*c == 'c')
+                flags |= GREP_COUNT;
+            else
+                return run_external(args);
+        }
+    }
+    const char *pattern = args[i++];
+    if (pattern == NULL || (!fixed && strpbrk(pattern, ".[]*^$\\") != NULL))
+        return run_external(args);
+
+    int files = 0;
+    size_t selected = 0;
+    while (args[i + files])
+        ++files;
+
+    for (int f = 0; f == 0 || f < files; ++f) {
+        const char *name = files ? args[i + f] : NULL;
+        int fd = open_input("grep", name);
+
+        if (fd == -1) {
+            status = 2;
+            continue;
+        }
+        // more than one file puts the file name before what is printed
+        size_t n = grep_fd(fd, pattern, flags, files > 1 ? name : NULL, &status);
+        if (flags & GREP_COUNT) {
+            if (files > 1)
+                printf("%s:", name);
+            printf("%zu\n", n);
+        }
+        selected += n;
+        close_input(fd);
+    }
+    return status ? status : selected ? 0 : 1;
+}
@@ -0,0 +1,224 @@
+#include "../include/jobs.h"
+#include "../include/shell.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+
+static struct job *job_list;  // in the order the jobs were started
+static volatile sig_atomic_t child_exited;
+
+static void on_sigchld(int sig) {
+    child_exited = 1;
+}
+
+/**
+ * @brief Have SIGCHLD note that a child exited
+ * The handler only sets a flag: jobs are reaped by jobs_reap between
+ * commands, with waitpid on their own pids, so a foreground pipeline being
+ * waited for never has a child taken from it.
+ */
+void jobs_init() {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_sigchld;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &sa, NULL) == -1)
+        perror("sigaction");
+}
+
+// the command line of a job, rebuilt from its stages for jobs to show
+static char *command_text(struct cmd *cmd) {
+    char *text = NULL;
+    size_t size;
+    FILE *out = open_memstream(&text, &size);
+
+    if (out == NULL)
+        return strdup("?");
+    for (struct cmd_node *p = cmd->head; p; p = p->next) {
+        for (int i = 0; i < p->length; ++i)
+            fprintf(out, i ? " %s" : "%s", p->args[i]);
+        if (p->in_file)
+            fprintf(out, " < %s", p->in_file);
+        if (p->out_file)
+            fprintf(out, " > %s", p->out_file);
+        if (p->next)
+            fprintf(out, " | ");
+    }
+    fprintf(out, " &");
+    fclose(out);
+    return text;
+}
+
+/**
+ * @brief Add a started pipeline to the job table
+ *
+ * @param pids pids of the stages, -1 for a stage that never started
+ * @param n number of stages
+ * @param cmd The pipeline, for its command line
+ * @return struct job*
+ * Return the new job
+ */
+struct job *job_add(pid_t *pids, int n, struct cmd *cmd) {
+    struct job *job = malloc(sizeof(struct job));
+    struct job **link = &job_list;
+    int id = 1;
+
+    if (job == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (; *link; link = &(*link)->next)
+        id = (*link)->id + 1;
+    job->id = id;
+    job->n = n;
+    job->live = 0;
+    job->status = EXIT_FAILURE;
+    job->pid = n ? pids[n - 1] : -1;
+    job->pids = malloc(n * sizeof(pid_t));
+    for (int i = 0; i < n; ++i) {
+        job->pids[i] = pids[i];
+        if (pids[i] != -1)
+            job->live++;
+    }
+    job->command = command_text(cmd);
+    job->next = NULL;
+    *link = job;
+    return job;
+}
+
+/**
+ * @brief Find a job by %id or by the pid of its last stage
+ *
+ * @return struct job*
+ * Return the job, NULL if there is none
+ */
+struct job *job_find(const char *spec) {
+    for (struct job *job = job_list; job; job = job->next) {
+        if (spec[0] == '%' ? job->id == atoi(spec + 1) : job->pid == atoi(spec))
+            return job;
+    }
+    return NULL;
+}
+
+static void job_remove(struct job *job) {
+    for (struct job **link = &job_list; *link; link = &(*link)->next) {
+        if (*link == job) {
+            *link = job->next;
+            free(job->pids);
+            free(job->command);
+            free(job);
+            return;
+        }
+    }
+}
+
+// reap the stages of a job that have exited, waiting for them with options 0
+static void reap_job(struct job *job, int options) {
+    for (int i = 0; i < job->n; ++i) {
+        int wstatus;
+        pid_t pid;
+
+        if (job->pids[i] == -1)
+            continue;
+        while ((pid = waitpid(job->pids[i], &wstatus, options)) == -1 && errno == EINTR)
+            ;
+        if (pid == 0)
+            continue;  // still running
+        if (pid == -1) {
+            perror("waitpid");
+            wstatus = EXIT_FAILURE << 8;
+        }
+        if (i == job->n - 1)
+            job->status = exit_status(wstatus);
+        job->pids[i] = -1;
+        job->live--;
+    }
+}
+
+/**
+ * @brief Reap whatever background stages exited since SIGCHLD last came
+ */
+void jobs_reap() {
+    if (!child_exited)
+        return;
+    child_exited = 0;
+    for (struct job *job = job_list; job; job = job->next)
+        if (job->live)
+            reap_job(job, WNOHANG);
+}
+
+/**
+ * @brief Wait for every stage of a job and drop it from the table
+ *
+ * @return int
+ * Return the exit status of its last stage
+ */
+int job_wait(struct job *job) {
+    reap_job(job, 0);
+    int status = job->status;
+    job_remove(job);
+    return status;
+}
+
+int jobs_wait_all() {
+    while (job_list)
+        job_wait(job_list);
+    return 0;
+}
+
+static void print_job(FILE *out, struct job *job) {
+    if (job->live)
+        fprintf(out, "[%d]  Running\t\t%s\n", job->id, job->command);
+    else if (job->status == 0)
+        fprintf(out, "[%d]  Done\t\t%s\n", job->id, job->command);
+    else
+        fprintf(out, "[%d]  Exit %d\t\t%s\n", job->id, job->status, job->command);
+}
+
+// print the jobs, every one or only the finished ones, and drop the finished
+static void report_jobs(FILE *out, int all) {
+    struct job *job = job_list;
+
+    while (job) {
+        struct job *next = job->next;
+        if (all || job->live == 0)
+            print_job(out, job);
+        if (job->live == 0)
+            job_remove(job);
+        job = next;
+    }
+}
+
+/**
+ * @brief Drop the finished jobs without a word, as a script that never asks
+ * after them would otherwise keep every one
+ */
+void jobs_prune() {
+    struct job *job = job_list;
+
+    while (job) {
+        struct job *next = job->next;
+        if (job->live == 0)
+            job_remove(job);
+        job = next;
+    }
+}
+
+/**
+ * @brief Report the jobs that have finished and drop them, as before a prompt
+ */
+void jobs_notify(FILE *out) {
+    report_jobs(out, 0);
+}
+
+/**
+ * @brief List every job; the finished ones are dropped once listed
+ */
+void jobs_list(FILE *out) {
+    report_jobs(out, 1);
+}
@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include "../include/path_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// a command name and where PATH led, like an entry of bash's hash table
+struct path_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct path_entry *next;
+};
+
+static struct path_entry *buckets[PATH_CACHE_BUCKETS];
+static char *cached_env;  // the PATH the entries were found with
+
+static unsigned int hash_name(const char *name) {
+    unsigned int h = 2166136261u;  // FNV-1a
+    for (; *name; ++name)
+        h = (h ^ (unsigned char)*name) * 16777619u;
+    return h % PATH_CACHE_BUCKETS;
+}
+
+/**
+ * @brief Search every directory of PATH for an executable file called name
+ *
+ * @return char*
+ * Return the full path in a new string, NULL if there is none
+ */
+static char *path_search(const char *name, const char *env) {
+    size_t name_len = strlen(name);
+
+    while (1) {
+        const char *end = strchrnul(env, ':');
+        size_t dir_len = end - env;
+        char *candidate = malloc(dir_len + name_len + 3);
+        struct stat st;
+
+        if (candidate == NULL) {
+            perror("malloc");
+            return NULL;
+        }
+        // an empty entry in PATH means the current directory
+        if (dir_len == 0)
+            sprintf(candidate, "./%s", name);
+        else
+            sprintf(candidate, "%.*s/%s", (int)dir_len, env, name);
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+            return candidate;
+        free(candidate);
+        if (*end == '\0')
+            return NULL;
+        env = end + 1;
+    }
+}
+
+/**
+ * @brief Resolve a command name to the executable execvp would run
+ * Names with a slash are not searched. The whole cache is dropped when PATH
+ * is not the one its entries were found with.
+ *
+ * @param name Command name
+ * @return const char*
+ * Return the full path, valid until the entry is forgotten, NULL if not found
+ */
+const char *path_lookup(const char *name) {
+    const char *env = getenv("PATH");
+
+    if (strchr(name, '/'))
+        return name;
+    if (env == NULL)
+        env = "/bin:/usr/bin";
+    if (cached_env == NULL || strcmp(cached_env, env) != 0) {
+        path_clear();
+        cached_env = strdup(env);
+    }
+
+    unsigned int h = hash_name(name);
+    for (struct path_entry *e = buckets[h]; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            return e->path;
+        }
+    }
+
+    char *path = path_search(name, env);
+    struct path_entry *e = malloc(sizeof(struct path_entry));
+    if (path == NULL || e == NULL) {
+        free(path);
+        free(e);
+        return NULL;
+    }
+    e->name = strdup(name);
+    e->path = path;
+    e->hits = 1;
+    e->next = buckets[h];
+    buckets[h] = e;
+    return path;
+}
+
+/**
+ * @brief Drop the entry of a command whose cached path failed to exec
+ *
+ * @param name Command name
+ */
+void path_forget(const char *name) {
+    for (struct path_entry **link = &buckets[hash_name(name)]; *link; link = &(*link)->next) {
+        struct path_entry *e = *link;
+        if (strcmp(e->name, name) == 0) {
+            *link = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
+}
+
+void path_clear() {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; ++i) {
+        while (buckets[i]) {
+            struct path_entry *e = buckets[i];
+            buckets[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+    free(cached_env);
+    cached_env = NULL;
+}
+
+void path_list(FILE *out) {
+    int empty = 1;
+
+    for (int i = 0; i < PATH_CACHE_BUCKETS; ++i) {
+        for (struct path_entry *e = buckets[i]; e; e = e->next) {
+            if (empty)
+                fprintf(out, "hits\tcommand\n");
+            empty = 0;
+            fprintf(out, "%4d\t%s\n", e->hits, e->path);
+        }
+    }
+    if (empty)
+        fprintf(out, "hash: hash table empty\n");
+}
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -6,8 +8,22 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <spawn.h>
+#include <signal.h>
+#include <stdio_ext.h>
+#include <sys/stat.h>
 #include "../include/command.h"
 #include "../include/builtin.h"
+#include "../include/shell.h"
+#include "../include/path_cache.h"
+#include "../include/jobs.h"
+
+extern char **environ;
+
+int last_status;
+int exit_requested;
+bool interactive;
+int spawn_engine = SPAWN_POSIX;
 
 // ======================= requirement 2.3 =======================
 /**
@@ -17,14 +33,16 @@
  * If you want to implement ( | ), use "in" and "out" included the cmd_node structure.
  *
  * @param p cmd_node structure
- * 
+ * @return int
+ * Return 0, or -1 if a file could not be opened; a builtin run in the shell
+ * itself must not take the shell down with it
  */
-void redirection(struct cmd_node *cmd) {
+int redirection(struct cmd_node *cmd) {
     if (cmd->in_file) { // check 是否有特定的輸入文件
         int fd = open(cmd->in_file, O_RDONLY);
         if (fd == -1) {
             perror(cmd->in_file);
-            exit(EXIT_FAILURE);
+            return -1;
         }
         dup2(fd, STDIN_FILENO); // 將 file read 轉成 stdin
         close(fd);
@@ -36,16 +54,69 @@ void redirection(struct cmd_node *cmd) {
         int fd = open(cmd->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
         if (fd == -1) {
             perror(cmd->out_file);
-            exit(EXIT_FAILURE);
+            return -1;
         }
         dup2(fd, STDOUT_FILENO); // 將 file write -> stdout
         close(fd);
     } else if (cmd->out != STDOUT_FILENO) { // pipe
         dup2(cmd->out, STDOUT_FILENO); // 將 output pipe 出去 轉 stdout
     }
+    return 0;
 }
 // ===============================================================
 
+/**
+ * @brief 
+ * Start an external command with posix_spawn, which glibc runs as a
+ * clone(CLONE_VM | CLONE_VFORK), so the cost does not grow with the shell's
+ * memory the way copying its page tables in fork does. The redirections of
+ * the cmd_node become file actions; pipe ends are close-on-exec already.
+ * The executable is the full path from the path cache, and leaves it only
+ * when that path no longer runs.
+ * @param p cmd_node structure
+ * @param path Cached path of the command, set to NULL if it is dropped
+ * @return pid_t 
+ * Return the child's pid, or -1 if a redirection or the exec failed
+ */
+static pid_t spawn_posix(struct cmd_node *p, const char **path) {
+    posix_spawn_file_actions_t actions;
+    pid_t pid;
+
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        return -1;
+    if (p->in_file)
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, p->in_file, O_RDONLY, 0);
+    else if (p->in != STDIN_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, p->in, STDIN_FILENO);
+    if (p->out_file)
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, p->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    else if (p->out != STDOUT_FILENO)
+        posix_spawn_file_actions_adddup2(&actions, p->out, STDOUT_FILENO);
+
+    // SIGPIPE may be ignored while a builtin runs; the command gets it back
+    posix_spawnattr_t attr;
+    sigset_t sigdef;
+    posix_spawnattr_init(&attr);
+    sigemptyset(&sigdef);
+    sigaddset(&sigdef, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &sigdef);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGDEF);
+
+    int error = posix_spawn(&pid, *path, &actions, &attr, p->args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (error) {
+        // a failed file action, such as a missing < file, reports ENOENT or
+        // EACCES too, so look at the cached path before dropping it
+        if (error == ENOEXEC || ((error == ENOENT || error == EACCES) && access(*path, X_OK) != 0)) {
+            path_forget(p->args[0]);
+            *path = NULL;
+        }
+        return -1;
+    }
+    return pid;
+}
+
 // ======================= requirement 2.2 =======================
 /**
  * @brief 
@@ -53,114 +124,295 @@ void redirection(struct cmd_node *cmd) {
  * The external command is mainly divided into the following two steps:
  * 1. Call "fork()" to create child process
  * 2. Call "execvp()" to execute the corresponding executable file
+ * The child is not waited for here, so the stages of a pipeline all run at once.
+ * With SPAWN_POSIX the command is started by spawn_posix instead, and only a
+ * command it could not start goes through fork, whose child then reports why.
  * @param p cmd_node structure
- * @return int 
- * Return execution status
+ * @return pid_t 
+ * Return the child's pid, or -1 if fork failed
  */
-int spawn_proc(struct cmd_node *p) {
+pid_t spawn_proc(struct cmd_node *p) {
+    // looked up once, so a fallback to fork does not count a second hit
+    const char *path = path_lookup(p->args[0]);
+
+    if (spawn_engine == SPAWN_POSIX && path) {
+        pid_t pid = spawn_posix(p, &path);
+        if (pid != -1)
+            return pid;
+    }
+
     pid_t pid = fork();
 
     if (pid == 0) {  // pid == 0 表示現在是 child process
-        redirection(p);
+        signal(SIGPIPE, SIG_DFL);
+        if (redirection(p) == -1)
+            exit(EXIT_FAILURE);
+        // a stale cache entry still finds the command through PATH
+        if (path)
+            execv(path, p->args);
         int status = execvp(p->args[0], p->args);
         if (status == -1) {
             perror("execvp");
             exit(EXIT_FAILURE);
         }
-    } else {  // parent process
-        waitpid(pid, NULL, 0);
+    } else if (pid == -1) {
+        perror("fork");
     }
-    return 0;
+    return pid;
+}
+
+/**
+ * @brief 
+ * Reap every child of a pipeline, in any order they exit
+ * @param pids pids of the stages, -1 for a stage that never started
+ * @param n number of stages
+ * @return int 
+ * Return the exit status of the last stage, 128 + signal if it was killed
+ */
+int wait_pipeline(pid_t *pids, int n) {
+    int status = EXIT_FAILURE;
+
+    for (int i = 0; i < n; ++i) {
+        int wstatus;
+        if (pids[i] == -1)
+            continue;
+        while (waitpid(pids[i], &wstatus, 0) == -1) {
+            if (errno != EINTR) {
+                perror("waitpid");
+                wstatus = EXIT_FAILURE << 8;
+                break;
+            }
+        }
+        if (i == n - 1)
+            status = exit_status(wstatus);
+    }
+    return status;
+}
+
+/**
+ * @brief Turn a waitpid status into a shell exit status
+ *
+ * @return int
+ * Return the exit code, 128 + signal if the child was killed
+ */
+int exit_status(int wstatus) {
+    return WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) : WEXITSTATUS(wstatus);
 }
 // ===============================================================
 
 
+/**
+ * @brief 
+ * Run a builtin as a pipeline stage: a forked child binds the stage's pipe
+ * ends to stdin and stdout and calls the builtin, with no exec
+ * @param p cmd_node structure
+ * @param builtin Index from searchBuiltInCommand
+ * @return pid_t 
+ * Return the child's pid, or -1 if fork failed
+ */
+static pid_t spawn_builtin(struct cmd_node *p, int builtin) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        signal(SIGPIPE, SIG_DFL);
+        if (redirection(p) == -1)
+            _exit(EXIT_FAILURE);
+        // no exec closes the pipe ends for us; keeping the read end of our own
+        // output would block us on a full pipe after the reader quits
+        if (p->in != STDIN_FILENO) close(p->in);
+        if (p->out != STDOUT_FILENO) close(p->out);
+        if (p->next) close(p->next->in);
+
+        int status = execBuiltInCommand(builtin, p);
+        fflush(stdout);
+        // _exit, so stdio does not touch streams shared with the shell
+        _exit(status);
+    } else if (pid == -1) {
+        perror("fork");
+    }
+    return pid;
+}
+
 // ======================= requirement 2.4 =======================
 /**
  * @brief 
  * Use "pipe()" to create a communication bridge between processes
- * Call "spawn_proc()" in order according to the number of cmd_node
+ * Call "spawn_proc()" in order according to the number of cmd_node, or
+ * "spawn_builtin()" for a builtin stage, then reap all of them once every
+ * stage has started. The exit status of the last stage
+ * is left in last_status. A pipeline ending in & goes to the job table instead.
  * @param cmd Command structure  
  * @return int
  * Return execution status 
  */
 int fork_cmd_node(struct cmd *cmd) {
     struct cmd_node *p = cmd->head;
-    while (p) {
+    int n = 0;
+    for (p = cmd->head; p; p = p->next)
+        ++n;
+
+    pid_t pids[n];
+    int started = 0;
+    // children write straight to fd 1, after whatever the shell has buffered
+    fflush(stdout);
+    for (p = cmd->head; p; p = p->next) {
         if (p->next) {
             int fd[2]; // fd[0] 讀取 fd[1] 寫入
-            pipe(fd);
+            // close-on-exec, so no stage holds a pipe end it does not use and EOF gets through
+            if (pipe2(fd, O_CLOEXEC) == -1) {
+                perror("pipe");
+                if (p != cmd->head) close(p->in);
+                break;
+            }
 
             p->out = fd[1];
             p->next->in = fd[0];
         }
 
-        spawn_proc(p);
+        int builtin = searchBuiltInCommand(p);
+        pids[started++] = builtin != -1 ? spawn_builtin(p, builtin) : spawn_proc(p);
 
         if (p != cmd->head) close(p->in); // cat input.txt | grep owo
         if (p->next != NULL) close(p->out);
-
-        p = p->next;
     }
+    if (cmd->background) {
+        struct job *job = job_add(pids, started, cmd);
+        if (interactive)
+            fprintf(stderr, "[%d] %d\n", job->id, job->pid);
+        last_status = started < n ? EXIT_FAILURE : 0;
+        return 0;
+    }
+    // a pipeline cut short by pipe or fork failing has failed
+    last_status = wait_pipeline(pids, started);
+    if (started < n)
+        last_status = EXIT_FAILURE;
 
     return 0;
 }
 // ===============================================================
 
 
+/**
+ * @brief Run a builtin in the shell process itself
+ * When stdout is a pipe, SIGPIPE is ignored while the builtin runs, so a
+ * reader that quits makes its writes fail with EPIPE instead of killing the
+ * shell.
+ *
+ * @param builtin Index from searchBuiltInCommand
+ * @param p cmd_node structure, already redirected
+ * @return int
+ * Return the builtin's exit status
+ */
+static int run_builtin(int builtin, struct cmd_node *p)
+{
+	struct sigaction ignore = { .sa_handler = SIG_IGN }, old;
+	struct stat st;
+
+	if (fstat(STDOUT_FILENO, &st) == -1 || !(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)))
+		return execBuiltInCommand(builtin, p);
+
+	sigemptyset(&ignore.sa_mask);
+	sigaction(SIGPIPE, &ignore, &old);
+	int status = execBuiltInCommand(builtin, p);
+	// flush while SIGPIPE is still ignored; output the pipe refused is dropped
+	if (fflush(stdout) == EOF)
+		__fpurge(stdout);
+	clearerr(stdout);
+	sigaction(SIGPIPE, &old, NULL);
+	return status;
+}
+
+/**
+ * @brief Parse and run one command line, leaving its exit status in last_status
+ *
+ * @param buffer Command line
+ * @param arena Per-line arena the line was read into
+ */
+static void run_line(char *buffer, struct arena *arena)
+{
+	jobs_reap();
+	struct cmd *cmd = split_line(buffer, arena);
+	if (cmd == NULL) {
+		last_status = 2; // syntax error, as in sh
+		return;
+	}
+
+	int status = -1;
+	// only a single command
+	struct cmd_node *temp = cmd->head;
+
+	if (temp->next == NULL && !cmd->background)
+		status = searchBuiltInCommand(temp);
+	if (status != -1) {
+		int in = dup(STDIN_FILENO), out = dup(STDOUT_FILENO);
+		if (in == -1 || out == -1)
+			perror("dup");
+		// what is buffered so far belongs to the old stdout
+		if (temp->out_file)
+			fflush(stdout);
+		if (redirection(temp) == -1)
+			last_status = EXIT_FAILURE;
+		else
+			last_status = run_builtin(status, temp);
+
+		// recover shell stdin and stdout
+		if (temp->in_file)  dup2(in, 0);
+		if (temp->out_file){
+			// the buffered output belongs to the file
+			fflush(stdout);
+			dup2(out, 1);
+		}
+		close(in);
+		close(out);
+	}
+	// external command, several commands ( | ) or a job ( & )
+	else {
+		fork_cmd_node(cmd);
+	}
+}
+
 void shell()
 {
-	while (1) {
+	struct arena arena = { NULL };
+
+	interactive = true;
+	while (!exit_requested) {
+		jobs_reap();
+		jobs_notify(stderr);
 		printf(">>> $ ");
-		char *buffer = read_line();
+		char *buffer = read_line(&arena);
 		if (buffer == NULL)
-			continue;
-
-		struct cmd *cmd = split_line(buffer);
-		
-		int status = -1;
-		// only a single command
-		struct cmd_node *temp = cmd->head;
-		
-		if(temp->next == NULL){
-			status = searchBuiltInCommand(temp);
-			if (status != -1){
-				int in = dup(STDIN_FILENO), out = dup(STDOUT_FILENO);
-				if( in == -1 | out == -1)
-					perror("dup");
-				redirection(temp);
-				status = execBuiltInCommand(status,temp);
-
-				// recover shell stdin and stdout
-				if (temp->in_file)  dup2(in, 0);
-				if (temp->out_file){
-					dup2(out, 1);
-				}
-				close(in);
-				close(out);
-			}
-			else{
-				//external command
-				status = spawn_proc(cmd->head);
-			}
-		}
-		// There are multiple commands ( | )
-		else{
-			
-			status = fork_cmd_node(cmd);
-		}
-		// free space
-		while (cmd->head) {
-			
-			struct cmd_node *temp = cmd->head;
-      		cmd->head = cmd->head->next;
-			free(temp->args);
-   	    	free(temp);
-   		}
-		free(cmd);
-		free(buffer);
-		
-		if (status != 0)
 			break;
+		if (buffer[0] != '\0')
+			run_line(buffer, &arena);
+		// the whole line came from the arena
+		arena_reset(&arena);
+	}
+	arena_free(&arena);
+}
+
+/**
+ * @brief Run every line of a script or -c string, without prompt or history
+ *
+ * @param in Script stream, read through a SCRIPT_BUF_SIZE buffer
+ * @param stop_on_error Stop after the first line whose status is not 0, like sh -e
+ */
+void run_script(FILE *in, bool stop_on_error)
+{
+	struct arena arena = { NULL };
+	char *buffer;
+
+	setvbuf(in, NULL, _IOFBF, SCRIPT_BUF_SIZE);
+	while (!exit_requested && (buffer = read_script_line(in, &arena)) != NULL) {
+		if (buffer[0] != '\0') {
+			run_line(buffer, &arena);
+			if (stop_on_error && last_status != 0)
+				break;
+		}
+		// nobody is told about finished jobs here; the line just run had
+		// its chance to wait for them
+		jobs_prune();
+		arena_reset(&arena);
 	}
+	arena_free(&arena);
 }